@@ -0,0 +1,67 @@
+/**
+ * Compares the native bitmap -> pixmap kernel against the JS loop it replaced in src/main/tray.ts,
+ * and cached against rebuilt dbusmenu GetLayout replies.
+ *
+ * @type {typeof import("./testing")}
+ */
+const libVesktop = require("./build/Release/libvesktop_testing.node");
+
+function jsBitmapToPixmap(bitmap, width, height) {
+    const pixmap = Buffer.allocUnsafe(8 + bitmap.length);
+    pixmap.writeUInt32LE(width, 0);
+    pixmap.writeUInt32LE(height, 4);
+
+    for (let i = 0; i < bitmap.length; i += 4) {
+        const r = bitmap[i];
+        const g = bitmap[i + 1];
+        const b = bitmap[i + 2];
+        const a = bitmap[i + 3];
+
+        const alpha = a / 255;
+        pixmap[8 + i] = a;
+        pixmap[8 + i + 1] = Math.round(b * alpha);
+        pixmap[8 + i + 2] = Math.round(g * alpha);
+        pixmap[8 + i + 3] = Math.round(r * alpha);
+    }
+
+    return pixmap;
+}
+
+function bench(name, fn, iterations) {
+    for (let i = 0; i < Math.min(iterations, 1000); i++) fn();
+
+    const start = process.hrtime.bigint();
+    for (let i = 0; i < iterations; i++) fn();
+    const elapsed = Number(process.hrtime.bigint() - start) / 1e3;
+
+    console.log(`  ${name.padEnd(8)} ${(elapsed / iterations).toFixed(3).padStart(10)} µs/op`);
+    return elapsed / iterations;
+}
+
+console.log(`pixmap kernel: ${libVesktop.getPixmapKernel()}`);
+
+for (const size of [22, 32, 64, 256]) {
+    const bitmap = Buffer.alloc(size * size * 4);
+    for (let i = 0; i < bitmap.length; i++) bitmap[i] = (i * 31) & 0xff;
+
+    const iterations = Math.max(200, Math.floor(20_000_000 / bitmap.length));
+
+    console.log(`${size}x${size}:`);
+    const js = bench("js", () => jsBitmapToPixmap(bitmap, size, size), iterations);
+    const native = bench("native", () => libVesktop.bitmapToPixmap(bitmap, size, size), iterations);
+    console.log(`  speedup  ${(js / native).toFixed(1).padStart(10)}x`);
+}
+
+console.log("GetLayout reply:");
+for (const items of [8, 64, 256]) {
+    const { rebuild, cached, filtered } = libVesktop.benchmarkMenuLayout(
+        items,
+        Math.max(1000, Math.floor(200_000 / items))
+    );
+
+    console.log(`${items} items:`);
+    console.log(`  rebuild  ${rebuild.toFixed(3).padStart(10)} µs/op`);
+    console.log(`  cached   ${cached.toFixed(3).padStart(10)} µs/op`);
+    console.log(`  filtered ${filtered.toFixed(3).padStart(10)} µs/op`);
+    console.log(`  speedup  ${(rebuild / cached).toFixed(1).padStart(10)}x`);
+}
@@ -1,22 +1,45 @@
 {
+  "variables": {
+    # Set LIBVESKTOP_TESTING=1 to also build libvesktop_testing, which adds the hooks test.js and bench.js use
+    "libvesktop_testing%": "<!(node -p \"process.env.LIBVESKTOP_TESTING ? 1 : 0\")"
+  },
+  "target_defaults": {
+    "sources": [
+      "src/libvesktop.cc",
+      "src/status_notifier_item.cc",
+      "src/pixmap.cc",
+      "src/session_bus.cc",
+      "src/main_context_thread.cc",
+      "src/appearance.cc",
+      "src/appearance_files.cc",
+      "src/launcher_entry.cc",
+      "src/menu_model.cc"
+    ],
+    "include_dirs": [
+      "<!@(node -p \"require('node-addon-api').include\")"
+    ],
+    "cflags_cc": [
+      "<!(pkg-config --cflags glib-2.0 gio-2.0)",
+      "-O3"
+    ],
+    "libraries": [
+      "<!@(pkg-config  --libs-only-l --libs-only-other glib-2.0 gio-2.0)"
+    ],
+    "cflags_cc!": ["-fno-exceptions"],
+  },
   "targets": [
     {
-      "target_name": "libvesktop",
-      "sources": [
-        "src/libvesktop.cc",
-        "src/status_notifier_item.cc"
-      ],
-      "include_dirs": [
-        "<!@(node -p \"require('node-addon-api').include\")"
-      ],
-      "cflags_cc": [
-        "<!(pkg-config --cflags glib-2.0 gio-2.0)",
-        "-O3"
-      ],
-      "libraries": [
-        "<!@(pkg-config  --libs-only-l --libs-only-other glib-2.0 gio-2.0)"
-      ],
-      "cflags_cc!": ["-fno-exceptions"],
+      "target_name": "libvesktop"
     }
+  ],
+  "conditions": [
+    ["libvesktop_testing==1", {
+      "targets": [
+        {
+          "target_name": "libvesktop_testing",
+          "defines": ["LIBVESKTOP_TESTING"]
+        }
+      ]
+    }]
   ]
-}
\ No newline at end of file
+}
@@ -1,6 +1,55 @@
 export function getAccentColor(): number | null;
 export function requestBackground(autoStart: boolean, commandLine: string[]): boolean;
+/**
+ * Launcher entry setters queue their change and return true. Repeated values are ignored and bursts
+ * are merged into one com.canonical.Unity.LauncherEntry Update signal per frame.
+ */
 export function updateUnityLauncherCount(count: number): boolean;
+/** Shows a progress bar on the launcher icon; progress is a fraction in [0, 1], null hides it */
+export function setUnityLauncherProgress(progress: number | null): boolean;
+export function setUnityLauncherUrgent(urgent: boolean): boolean;
+
+export interface PortalCallOptions {
+    /** D-Bus call timeout in milliseconds (default 5000) */
+    timeout?: number;
+    /** Cancels the call; the promise then rejects with an AbortError */
+    signal?: AbortSignal;
+}
+
+/** Like getAccentColor, but runs off the main thread */
+export function getAccentColorAsync(options?: PortalCallOptions): Promise<number | null>;
+/** Like requestBackground, but runs off the main thread */
+export function requestBackgroundAsync(
+    autoStart: boolean,
+    commandLine: string[],
+    options?: PortalCallOptions
+): Promise<boolean>;
+export interface Appearance {
+    /** 0xRRGGBB, or null if the desktop doesn't set one */
+    accentColor: number | null;
+    colorScheme: "no-preference" | "dark" | "light";
+    contrast: "no-preference" | "high";
+}
+
+/**
+ * Reads org.freedesktop.appearance once and keeps it cached natively, following the portal's
+ * SettingChanged signal. Resolves right away with values read from kdeglobals / GTK's settings.ini,
+ * which the portal's answer replaces once it arrives. Without a portal those files are watched instead.
+ * The callback only runs when a value actually changes; calling again replaces it.
+ */
+export function watchAppearance(callback?: (appearance: Appearance) => void): Promise<Appearance | null>;
+/** The cached appearance, or null before watchAppearance() has been called */
+export function getAppearance(): Appearance | null;
+/** Whether the addon's shared session bus connection is open. Does not connect on its own */
+export function isSessionBusConnected(): boolean;
+
+/**
+ * Converts a straight-alpha BGRA bitmap (as returned by NativeImage.toBitmap()) into the
+ * width/height-prefixed premultiplied ARGB32 pixmap accepted by setStatusNotifierIcon.
+ */
+export function bitmapToPixmap(bitmap: Buffer, width: number, height: number, stride?: number): Buffer;
+/** Name of the SIMD kernel bitmapToPixmap uses on this CPU */
+export function getPixmapKernel(): "avx2" | "sse2" | "neon" | "scalar";
 
 export interface MenuItem {
     id: number;
@@ -8,13 +57,123 @@ export interface MenuItem {
     enabled?: boolean;
     visible?: boolean;
     type?: "separator";
+    /**
+     * Checkmark items flip and radio items turn on when clicked, without waiting for JS; radio items
+     * under the same parent form one group
+     */
+    toggleType?: "checkmark" | "radio";
+    checked?: boolean;
+    /** Items of this entry's submenu */
+    submenu?: MenuItem[];
+}
+
+export interface IconSlot {
+    name: string;
+    bitmap: Buffer;
+    width: number;
+    height: number;
+    stride?: number;
 }
 
-export function initStatusNotifierItem(): boolean;
+export type AnimationFrame =
+    | { slot: number; duration: number }
+    | { bitmap: Buffer; width: number; height: number; stride?: number; duration: number };
+
+/**
+ * Starts the tray item on libvesktop's own D-Bus thread. The setters below may be called right away;
+ * they queue the change for that thread and return once it is queued, not once it is applied.
+ */
+export function initStatusNotifierItem(): Promise<boolean>;
 export function setStatusNotifierIcon(pixmapData: Buffer): boolean;
+/**
+ * Sets the tray icon from a NativeImage.toBitmap() buffer at its original size. The icon is resampled
+ * natively to 16, 22, 24, 32, 48 and 64 px so hosts can pick an exact match.
+ */
+export function setStatusNotifierIconBitmap(bitmap: Buffer, width: number, height: number, stride?: number): boolean;
+/**
+ * Converts and caches a set of icons once. Switching between them with selectStatusNotifierIconSlot
+ * then only swaps a prebuilt IconPixmap and emits NewIcon. Replaces any previously registered slots.
+ */
+export function registerStatusNotifierIconSlots(slots: IconSlot[]): boolean;
+export function selectStatusNotifierIconSlot(index: number): boolean;
+/** Slot hosts show while the status is NeedsAttention */
+export function setStatusNotifierAttentionIconSlot(index: number): boolean;
+/**
+ * Draws the unread count (1-99, then "99+") onto the selected and attention slots. Results are cached
+ * per slot and count. Values <= 0 remove the badge.
+ */
+export function setStatusNotifierBadgeCount(count: number): boolean;
+/** Plays frames (durations in ms) in place of the selected slot; pauses while no tray host is registered */
+export function setStatusNotifierAnimation(frames: AnimationFrame[], loop?: boolean): boolean;
+export function stopStatusNotifierAnimation(): boolean;
+export function setStatusNotifierStatus(status: "Active" | "Passive" | "NeedsAttention"): boolean;
 export function setStatusNotifierTitle(title: string): boolean;
+/** Ids must be unique across the whole tree and non-zero; a menu that breaks this is ignored */
 export function setStatusNotifierMenu(items: MenuItem[]): boolean;
 export function updateStatusNotifierMenuItem(id: number, label: string): boolean;
-export function setStatusNotifierMenuClickCallback(callback: (id: number) => void): boolean;
-export function setStatusNotifierActivateCallback(callback: () => void): boolean;
+export interface MenuItemUpdate {
+    id: number;
+    label?: string;
+    enabled?: boolean;
+    visible?: boolean;
+    checked?: boolean;
+}
+/**
+ * Changes properties of existing items without a relayout. Hosts get one ItemsPropertiesUpdated
+ * carrying only the properties that actually changed.
+ */
+export function updateStatusNotifierMenuItems(updates: MenuItemUpdate[]): boolean;
+/**
+ * timestamp is the event time reported by the tray host. For toggle items, checked is the state the
+ * click left the item in; the host has already been told.
+ */
+export function setStatusNotifierMenuClickCallback(
+    callback: (id: number, timestamp: number, checked?: boolean) => void
+): boolean;
+/** x and y are the screen coordinates of the click, if the host reports them */
+export function setStatusNotifierActivateCallback(callback: (x: number, y: number) => void): boolean;
+/** Usually a middle click on the icon */
+export function setStatusNotifierSecondaryActivateCallback(callback: (x: number, y: number) => void): boolean;
+/** Only sent by hosts that don't show the menu themselves */
+export function setStatusNotifierContextMenuCallback(callback: (x: number, y: number) => void): boolean;
+/**
+ * Wheel movement over the icon. Deltas are summed natively and delivered at most once per frame, with
+ * one call per orientation that moved; movement that cancels out within a frame isn't reported.
+ */
+export function setStatusNotifierScrollCallback(
+    callback: (delta: number, orientation: "vertical" | "horizontal") => void
+): boolean;
+/**
+ * Called when a host is about to show the menu (id is the item being opened) to bring it up to date.
+ * Return the items that may have changed; only what differs from the current menu is sent. The host
+ * waits up to 100 ms for the answer. Pass null to stop.
+ */
+export function setStatusNotifierMenuProvider(provider: ((id: number) => MenuItemUpdate[] | void) | null): boolean;
+/**
+ * Caps how often icon, title and menu label changes are announced to the host (default 30 Hz, 0 = no cap).
+ * Throws a RangeError for anything but 0 or a finite rate of at least 0.1 Hz.
+ */
+export function setStatusNotifierUpdateRate(hz: number): boolean;
+/**
+ * Holds back every tray signal until the matching commitStatusNotifierUpdate(), so a change that spans
+ * several setters makes the host refetch once. Calls nest. Without a transaction, setters called back
+ * to back usually share a batch but aren't guaranteed to: the tray thread may flush between them.
+ */
+export function beginStatusNotifierUpdate(): boolean;
+export function commitStatusNotifierUpdate(): boolean;
+
+export interface StatusNotifierStats {
+    /** signals sent to the bus */
+    emitted: number;
+    /** updates folded into an already pending signal */
+    merged: number;
+    /** updates that changed nothing visible, e.g. re-selecting an icon with identical pixels */
+    dropped: number;
+    /** flushes that sent at least one signal */
+    batches: number;
+    /** tray events lost because JS did not keep up with the host */
+    eventsDropped: number;
+}
+
+export function getStatusNotifierStats(): StatusNotifierStats | null;
 export function destroyStatusNotifierItem(): void;
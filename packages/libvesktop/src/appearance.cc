@@ -0,0 +1,312 @@
+#include "appearance.h"
+#include "appearance_files.h"
+#include "session_bus.h"
+#include <cmath>
+#include <iostream>
+
+// Some portal versions wrap values in extra variants
+static GVariantPtr unwrap_variant(GVariant *value)
+{
+    GVariantPtr inner(g_variant_ref(value));
+
+    while (g_variant_is_of_type(inner.get(), G_VARIANT_TYPE_VARIANT))
+        inner.reset(g_variant_get_variant(inner.get()));
+
+    return inner;
+}
+
+std::optional<int32_t> parse_accent_color(GVariant *value)
+{
+    GVariantPtr inner = unwrap_variant(value);
+
+    if (!g_variant_is_of_type(inner.get(), G_VARIANT_TYPE("(ddd)")))
+        return std::nullopt;
+
+    double r = 0.0, g = 0.0, b = 0.0;
+    g_variant_get(inner.get(), "(ddd)", &r, &g, &b);
+
+    int32_t rgb = 0;
+    for (double component : {r, g, b})
+    {
+        if (!std::isfinite(component) || component < 0.0 || component > 1.0)
+            return std::nullopt;
+
+        rgb = (rgb << 8) | static_cast<int32_t>(std::round(component * 255.0));
+    }
+
+    return rgb;
+}
+
+static std::optional<uint32_t> parse_uint32(GVariant *value)
+{
+    GVariantPtr inner = unwrap_variant(value);
+
+    if (!g_variant_is_of_type(inner.get(), G_VARIANT_TYPE_UINT32))
+        return std::nullopt;
+
+    return g_variant_get_uint32(inner.get());
+}
+
+AppearanceMonitor::AppearanceMonitor(ChangeCallback on_change)
+    : on_change(std::move(on_change))
+{
+}
+
+AppearanceMonitor::~AppearanceMonitor()
+{
+    if (bus_listener_id != 0)
+        remove_session_bus_listener(bus_listener_id);
+
+    if (cancellable)
+        g_cancellable_cancel(cancellable.get());
+
+    if (subscription_id != 0)
+        g_dbus_connection_signal_unsubscribe(bus.get(), subscription_id);
+}
+
+bool AppearanceMonitor::start()
+{
+    bool connected = connect_portal();
+
+    // A subscription on a closed connection never fires again, and a bus that wasn't there at startup
+    // may turn up later
+    bus_listener_id = add_session_bus_listener([this] { connect_portal(); });
+
+    if (!connected)
+    {
+        watch_files();
+        finish_loading();
+    }
+
+    return connected;
+}
+
+bool AppearanceMonitor::connect_portal()
+{
+    GError *error = nullptr;
+    GObjectPtr<GDBusConnection> next = get_session_bus(&error);
+
+    if (!next)
+    {
+        GErrorPtr error_ptr(error);
+        std::cerr << "[libvesktop::AppearanceMonitor] Failed to connect to session bus: "
+                  << (error_ptr ? error_ptr->message : "unknown error") << std::endl;
+        return false;
+    }
+
+    if (next.get() == bus.get())
+        return true;
+
+    if (cancellable)
+    {
+        g_cancellable_cancel(cancellable.get());
+        cancellable.reset();
+    }
+
+    if (subscription_id != 0)
+    {
+        g_dbus_connection_signal_unsubscribe(bus.get(), subscription_id);
+        subscription_id = 0;
+    }
+
+    bus = std::move(next);
+
+    // Subscribe before reading so nothing that changes in between is missed
+    subscription_id = g_dbus_connection_signal_subscribe(
+        bus.get(),
+        "org.freedesktop.portal.Desktop",
+        "org.freedesktop.portal.Settings",
+        "SettingChanged",
+        "/org/freedesktop/portal/desktop",
+        NAMESPACE,
+        G_DBUS_SIGNAL_FLAGS_NONE,
+        on_setting_changed,
+        this,
+        nullptr);
+
+    GVariantBuilder namespaces;
+    g_variant_builder_init(&namespaces, G_VARIANT_TYPE("as"));
+    g_variant_builder_add(&namespaces, "s", NAMESPACE);
+
+    cancellable.reset(g_cancellable_new());
+
+    g_dbus_connection_call(
+        bus.get(),
+        "org.freedesktop.portal.Desktop",
+        "/org/freedesktop/portal/desktop",
+        "org.freedesktop.portal.Settings",
+        "ReadAll",
+        g_variant_new("(as)", &namespaces),
+        G_VARIANT_TYPE("(a{sa{sv}})"),
+        G_DBUS_CALL_FLAGS_NONE,
+        5000,
+        cancellable.get(),
+        on_read_all,
+        this);
+
+    return true;
+}
+
+std::optional<AppearanceSettings> AppearanceMonitor::get() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!loaded)
+        return std::nullopt;
+
+    return settings;
+}
+
+bool AppearanceMonitor::apply(AppearanceSettings &settings, const char *key, GVariant *value)
+{
+    if (g_strcmp0(key, "accent-color") == 0)
+        settings.accent_color = parse_accent_color(value);
+    else if (g_strcmp0(key, "color-scheme") == 0)
+        settings.color_scheme = parse_uint32(value).value_or(0);
+    else if (g_strcmp0(key, "contrast") == 0)
+        settings.contrast = parse_uint32(value).value_or(0);
+    else
+        return false;
+
+    return true;
+}
+
+void AppearanceMonitor::update(const AppearanceSettings &next)
+{
+    bool report;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (settings == next)
+            return;
+
+        settings = next;
+        // Waiters get the initial values from finish_loading(); only later changes are reported
+        report = loaded;
+    }
+
+    if (report && on_change)
+        on_change(next);
+}
+
+void AppearanceMonitor::watch_files()
+{
+    if (file_watcher)
+        return;
+
+    file_watcher = std::make_unique<AppearanceFileWatcher>([this] {
+        update(read_appearance_from_files());
+    });
+
+    // Read after the watches go up so a change in between isn't missed
+    update(read_appearance_from_files());
+}
+
+void AppearanceMonitor::when_loaded(std::function<void()> callback)
+{
+    if (get())
+        callback();
+    else
+        load_waiters.push_back(std::move(callback));
+}
+
+void AppearanceMonitor::finish_loading()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        loaded = true;
+    }
+
+    for (auto &waiter : load_waiters)
+        waiter();
+    load_waiters.clear();
+}
+
+void AppearanceMonitor::on_read_all(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    GError *error = nullptr;
+    GVariantPtr reply(g_dbus_connection_call_finish(reinterpret_cast<GDBusConnection *>(source), result, &error));
+    GErrorPtr error_ptr(error);
+
+    // Cancelled calls may complete after the monitor is gone, so don't touch it
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+    auto *self = static_cast<AppearanceMonitor *>(user_data);
+    self->cancellable.reset();
+
+    if (!reply)
+    {
+        // Without a portal the config files stay in charge; SettingChanged still applies if one shows up later
+        std::cerr << "[libvesktop::AppearanceMonitor] Failed to call ReadAll: "
+                  << (error ? error->message : "unknown error") << std::endl;
+        self->watch_files();
+        self->finish_loading();
+        return;
+    }
+
+    AppearanceSettings next;
+    bool found = false;
+
+    GVariantIter *namespaces = nullptr;
+    g_variant_get(reply.get(), "(a{sa{sv}})", &namespaces);
+
+    const gchar *namespace_name;
+    GVariantIter *values;
+    while (g_variant_iter_next(namespaces, "{&sa{sv}}", &namespace_name, &values))
+    {
+        const gchar *key;
+        GVariant *value;
+        while (g_variant_iter_next(values, "{&sv}", &key, &value))
+        {
+            found |= apply(next, key, value);
+            g_variant_unref(value);
+        }
+        g_variant_iter_free(values);
+    }
+    g_variant_iter_free(namespaces);
+
+    // Some portal backends (e.g. wlroots-only setups) don't implement the namespace at all
+    if (!found)
+    {
+        self->watch_files();
+        self->finish_loading();
+        return;
+    }
+
+    // The portal is authoritative once it answers
+    self->file_watcher.reset();
+    self->update(next);
+    self->finish_loading();
+}
+
+void AppearanceMonitor::on_setting_changed(
+    GDBusConnection *connection,
+    const gchar *sender_name,
+    const gchar *object_path,
+    const gchar *interface_name,
+    const gchar *signal_name,
+    GVariant *parameters,
+    gpointer user_data)
+{
+    auto *self = static_cast<AppearanceMonitor *>(user_data);
+
+    if (!g_variant_is_of_type(parameters, G_VARIANT_TYPE("(ssv)")))
+        return;
+
+    const gchar *namespace_name;
+    const gchar *key;
+    GVariant *value;
+    g_variant_get(parameters, "(&s&sv)", &namespace_name, &key, &value);
+    GVariantPtr value_ptr(value);
+
+    // May arrive before ReadAll has answered, so read the cache directly rather than through get()
+    AppearanceSettings next;
+    {
+        std::lock_guard<std::mutex> lock(self->mutex);
+        next = self->settings;
+    }
+
+    if (apply(next, key, value))
+        self->update(next);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <gio/gio.h>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include "glib_ptr.h"
+
+// Values of the org.freedesktop.appearance portal namespace
+struct AppearanceSettings
+{
+    // 0xRRGGBB, unset if the desktop doesn't provide one
+    std::optional<int32_t> accent_color;
+    // 0 = no preference, 1 = prefer dark, 2 = prefer light
+    uint32_t color_scheme = 0;
+    // 0 = no preference, 1 = high contrast
+    uint32_t contrast = 0;
+
+    bool operator==(const AppearanceSettings &other) const
+    {
+        return accent_color == other.accent_color && color_scheme == other.color_scheme && contrast == other.contrast;
+    }
+    bool operator!=(const AppearanceSettings &other) const
+    {
+        return !(*this == other);
+    }
+};
+
+// Converts the portal's (ddd) accent color, unwrapping any nesting variants. Out of range
+// components (the portal's way of saying "unset") give nullopt.
+std::optional<int32_t> parse_accent_color(GVariant *value);
+
+class AppearanceFileWatcher;
+
+// Mirrors org.freedesktop.appearance: one ReadAll up front, then SettingChanged keeps the cache
+// current. If there is no portal, or it lacks the namespace, values come from the desktop's config
+// files instead. Everything but get() must be called on the thread whose main context receives the updates.
+class AppearanceMonitor
+{
+public:
+    using ChangeCallback = std::function<void(const AppearanceSettings &)>;
+
+    explicit AppearanceMonitor(ChangeCallback on_change);
+    ~AppearanceMonitor();
+
+    AppearanceMonitor(const AppearanceMonitor &) = delete;
+    AppearanceMonitor &operator=(const AppearanceMonitor &) = delete;
+
+    // Subscribes and starts the portal read; values are loaded once it settles. Returns false if there
+    // is no session bus, in which case the config files are read and watched right away. Either way the
+    // subscription and read are redone on every new session bus connection.
+    bool start();
+    // Runs callback once the initial values are known (right away if they already are)
+    void when_loaded(std::function<void()> callback);
+
+    // Safe to call from any thread; nullopt until start() has been called
+    std::optional<AppearanceSettings> get() const;
+
+private:
+    static constexpr const char *NAMESPACE = "org.freedesktop.appearance";
+
+    GObjectPtr<GDBusConnection> bus;
+    GObjectPtr<GCancellable> cancellable;
+    guint subscription_id = 0;
+    guint bus_listener_id = 0;
+    ChangeCallback on_change;
+    std::vector<std::function<void()>> load_waiters;
+    std::unique_ptr<AppearanceFileWatcher> file_watcher;
+
+    mutable std::mutex mutex;
+    AppearanceSettings settings;
+    bool loaded = false;
+
+    // Returns true if the key is one we track
+    static bool apply(AppearanceSettings &settings, const char *key, GVariant *value);
+    // Stores next and reports it if it differs from what we had
+    void update(const AppearanceSettings &next);
+    void finish_loading();
+    void watch_files();
+    // Moves the subscription onto the shared connection and reads everything again; does nothing if
+    // it is already there. Returns false if there is no session bus.
+    bool connect_portal();
+
+    static void on_read_all(GObject *source, GAsyncResult *result, gpointer user_data);
+    static void on_setting_changed(
+        GDBusConnection *connection,
+        const gchar *sender_name,
+        const gchar *object_path,
+        const gchar *interface_name,
+        const gchar *signal_name,
+        GVariant *parameters,
+        gpointer user_data);
+};
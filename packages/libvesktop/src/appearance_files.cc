@@ -0,0 +1,276 @@
+#include "appearance_files.h"
+#include <glib-unix.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+// Names of the files we read, relative to the user config dir
+static const char *const KDEGLOBALS = "kdeglobals";
+static const char *const GTK_SETTINGS[] = {"gtk-4.0/settings.ini", "gtk-3.0/settings.ini"};
+
+// Most tools save by replacing the file, hence more than IN_CLOSE_WRITE
+static constexpr uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE;
+
+// Minimal INI reader. GKeyFile rejects some of what KDE writes (e.g. "Key[$e]=..." entries), and
+// one bad line would make it drop the whole file.
+class IniFile
+{
+public:
+    bool load(const char *relative_path)
+    {
+        gchar *path = g_build_filename(g_get_user_config_dir(), relative_path, nullptr);
+        gchar *contents = nullptr;
+        bool loaded = g_file_get_contents(path, &contents, nullptr, nullptr);
+        g_free(path);
+
+        if (!loaded)
+            return false;
+
+        gchar **lines = g_strsplit(contents, "\n", -1);
+        g_free(contents);
+
+        std::string group;
+        for (gchar **line = lines; *line; line++)
+        {
+            std::string text = g_strstrip(*line);
+
+            if (text.empty() || text[0] == '#' || text[0] == ';')
+                continue;
+
+            if (text.front() == '[' && text.back() == ']')
+            {
+                group = text.substr(1, text.size() - 2);
+                continue;
+            }
+
+            size_t equals = text.find('=');
+            if (equals == std::string::npos)
+                continue;
+
+            // Drop KDE's "[$e]"-style flags and surrounding whitespace from the key
+            std::string key = text.substr(0, std::min(equals, text.find('[')));
+            std::string value = text.substr(equals + 1);
+            key.erase(key.find_last_not_of(" \t") + 1);
+            value.erase(0, value.find_first_not_of(" \t"));
+
+            entries[group + '\x1f' + key] = value;
+        }
+
+        g_strfreev(lines);
+        return true;
+    }
+
+    std::string get(const char *group, const char *key) const
+    {
+        auto it = entries.find(std::string(group) + '\x1f' + key);
+        return it != entries.end() ? it->second : "";
+    }
+
+private:
+    std::map<std::string, std::string> entries;
+};
+
+// Parses KDE's "r,g,b" color lists
+static bool parse_kde_color(const std::string &value, int &r, int &g, int &b)
+{
+    return sscanf(value.c_str(), "%d,%d,%d", &r, &g, &b) == 3 &&
+           r >= 0 && r <= 255 && g >= 0 && g <= 255 && b >= 0 && b <= 255;
+}
+
+static bool contains_ignore_case(const std::string &haystack, const char *needle)
+{
+    gchar *lower = g_ascii_strdown(haystack.c_str(), -1);
+    bool found = strstr(lower, needle) != nullptr;
+    g_free(lower);
+    return found;
+}
+
+static bool is_kde_session()
+{
+    const char *desktop = std::getenv("XDG_CURRENT_DESKTOP");
+    return desktop && strstr(desktop, "KDE");
+}
+
+// Fills in what kdeglobals knows; returns whether it had a color scheme
+static bool read_kdeglobals(AppearanceSettings &settings)
+{
+    IniFile kdeglobals;
+    if (!kdeglobals.load(KDEGLOBALS))
+        return false;
+
+    int r, g, b;
+    if (parse_kde_color(kdeglobals.get("General", "AccentColor"), r, g, b))
+        settings.accent_color = (r << 16) | (g << 8) | b;
+
+    // The window background is what KDE itself uses to decide whether a scheme is dark
+    if (parse_kde_color(kdeglobals.get("Colors:Window", "BackgroundNormal"), r, g, b))
+    {
+        double luma = 0.2126 * r + 0.7152 * g + 0.0722 * b;
+        settings.color_scheme = luma < 128.0 ? 1 : 2;
+        return true;
+    }
+
+    return false;
+}
+
+// Fills in what GTK's settings.ini knows; returns whether it had a color scheme
+static bool read_gtk_settings(AppearanceSettings &settings)
+{
+    for (const char *relative_path : GTK_SETTINGS)
+    {
+        IniFile gtk_settings;
+        if (!gtk_settings.load(relative_path))
+            continue;
+
+        std::string prefer_dark = gtk_settings.get("Settings", "gtk-application-prefer-dark-theme");
+        std::string theme = gtk_settings.get("Settings", "gtk-theme-name");
+
+        if (contains_ignore_case(theme, "highcontrast"))
+            settings.contrast = 1;
+
+        if (prefer_dark == "true" || prefer_dark == "1" || contains_ignore_case(theme, "-dark"))
+        {
+            settings.color_scheme = 1;
+            return true;
+        }
+
+        if (!prefer_dark.empty() || !theme.empty())
+        {
+            settings.color_scheme = 2;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+AppearanceSettings read_appearance_from_files()
+{
+    AppearanceSettings settings;
+
+    // Both files often exist side by side; trust the one belonging to the running desktop for the scheme
+    if (is_kde_session())
+    {
+        AppearanceSettings gtk;
+        read_gtk_settings(gtk);
+        settings.contrast = gtk.contrast;
+
+        if (!read_kdeglobals(settings))
+            settings.color_scheme = gtk.color_scheme;
+    }
+    else
+    {
+        AppearanceSettings kde;
+        bool kde_has_scheme = read_kdeglobals(kde);
+        settings.accent_color = kde.accent_color;
+
+        if (!read_gtk_settings(settings) && kde_has_scheme)
+            settings.color_scheme = kde.color_scheme;
+    }
+
+    return settings;
+}
+
+AppearanceFileWatcher::AppearanceFileWatcher(std::function<void()> on_change)
+    : on_change(std::move(on_change))
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+    {
+        std::cerr << "[libvesktop::AppearanceFileWatcher] inotify_init1 failed: " << strerror(errno) << std::endl;
+        return;
+    }
+
+    config_dir_watch = inotify_add_watch(inotify_fd, g_get_user_config_dir(), WATCH_MASK);
+    bool watching = config_dir_watch >= 0;
+
+    for (const char *relative_path : GTK_SETTINGS)
+    {
+        gchar *dir = g_path_get_dirname(relative_path);
+        watching |= watch_settings_dir(dir);
+        g_free(dir);
+    }
+
+    if (!watching)
+    {
+        close(inotify_fd);
+        inotify_fd = -1;
+        return;
+    }
+
+    source = g_unix_fd_source_new(inotify_fd, G_IO_IN);
+    g_source_set_callback(source, reinterpret_cast<GSourceFunc>(on_inotify_ready), this, nullptr);
+    g_source_attach(source, g_main_context_get_thread_default());
+}
+
+AppearanceFileWatcher::~AppearanceFileWatcher()
+{
+    if (source)
+    {
+        g_source_destroy(source);
+        g_source_unref(source);
+    }
+
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+}
+
+bool AppearanceFileWatcher::watch_settings_dir(const char *dir)
+{
+    gchar *path = g_build_filename(g_get_user_config_dir(), dir, nullptr);
+    bool watching = inotify_add_watch(inotify_fd, path, WATCH_MASK) >= 0;
+    g_free(path);
+
+    return watching;
+}
+
+gboolean AppearanceFileWatcher::on_inotify_ready(gint fd, GIOCondition condition, gpointer user_data)
+{
+    auto *self = static_cast<AppearanceFileWatcher *>(user_data);
+    bool relevant = false;
+
+    alignas(struct inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t offset = 0; offset < length;)
+        {
+            auto *event = reinterpret_cast<struct inotify_event *>(buffer + offset);
+            offset += sizeof(struct inotify_event) + event->len;
+
+            if (event->len == 0)
+                continue;
+
+            // A GTK settings dir that didn't exist at startup; watch it from now on and read whatever
+            // was written to it before the watch went up
+            if ((event->mask & IN_ISDIR) && event->wd == self->config_dir_watch)
+            {
+                for (const char *relative_path : GTK_SETTINGS)
+                {
+                    gchar *dir = g_path_get_dirname(relative_path);
+                    if (strcmp(event->name, dir) == 0 && self->watch_settings_dir(dir))
+                        relevant = true;
+                    g_free(dir);
+                }
+
+                continue;
+            }
+
+            // The config dir sees every app's writes; only react to the files we read
+            if (strcmp(event->name, KDEGLOBALS) == 0 || strcmp(event->name, "settings.ini") == 0)
+                relevant = true;
+        }
+    }
+
+    // Saves arrive as several events; the caller compares values, so one refresh per batch is enough
+    if (relevant)
+        self->on_change();
+
+    return G_SOURCE_CONTINUE;
+}
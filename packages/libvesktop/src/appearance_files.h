@@ -0,0 +1,39 @@
+#pragma once
+
+#include <gio/gio.h>
+#include <functional>
+#include <string>
+#include "appearance.h"
+
+// Reads appearance settings straight from kdeglobals and GTK's settings.ini, for sessions without
+// xdg-desktop-portal. Only touches the filesystem, so it is cheap enough for first paint.
+AppearanceSettings read_appearance_from_files();
+
+// Watches the files read_appearance_from_files() looks at with inotify, calling on_change on the
+// thread-default main context of the thread that created it. Directories are watched rather than
+// files, since most tools save by replacing the file.
+class AppearanceFileWatcher
+{
+public:
+    explicit AppearanceFileWatcher(std::function<void()> on_change);
+    ~AppearanceFileWatcher();
+
+    AppearanceFileWatcher(const AppearanceFileWatcher &) = delete;
+    AppearanceFileWatcher &operator=(const AppearanceFileWatcher &) = delete;
+
+    bool is_watching() const
+    {
+        return source != nullptr;
+    }
+
+private:
+    int inotify_fd = -1;
+    // Watch descriptor of the config dir itself, where the GTK settings dirs may show up later
+    int config_dir_watch = -1;
+    GSource *source = nullptr;
+    std::function<void()> on_change;
+
+    // Watches dir (relative to the config dir); returns false if it doesn't exist
+    bool watch_settings_dir(const char *dir);
+    static gboolean on_inotify_ready(gint fd, GIOCondition condition, gpointer user_data);
+};
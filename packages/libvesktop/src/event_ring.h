@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// Fixed-size single-producer/single-consumer queue. push() fails instead of blocking when the
+// consumer falls behind, so a stalled JS thread can never hold up the producer.
+template <typename T, size_t Capacity>
+class EventRing
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    bool push(const T &value)
+    {
+        size_t tail_index = tail.load(std::memory_order_relaxed);
+        if (tail_index - head.load(std::memory_order_acquire) == Capacity)
+            return false;
+
+        slots[tail_index & (Capacity - 1)] = value;
+        tail.store(tail_index + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &value)
+    {
+        size_t head_index = head.load(std::memory_order_relaxed);
+        if (head_index == tail.load(std::memory_order_acquire))
+            return false;
+
+        value = slots[head_index & (Capacity - 1)];
+        head.store(head_index + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::array<T, Capacity> slots;
+    // Kept on separate cache lines so the producer and consumer don't invalidate each other
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
@@ -0,0 +1,154 @@
+#include "launcher_entry.h"
+#include "glib_ptr.h"
+#include "session_bus.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+LauncherEntry::LauncherEntry()
+    : context(g_main_context_ref_thread_default())
+{
+    const char *chrome_desktop = std::getenv("CHROME_DESKTOP");
+    app_uri = std::string("application://") + (chrome_desktop ? chrome_desktop : "vesktop.desktop");
+}
+
+LauncherEntry::~LauncherEntry()
+{
+    if (flush_source)
+    {
+        g_source_destroy(flush_source);
+        g_source_unref(flush_source);
+    }
+
+    g_main_context_unref(context);
+}
+
+void LauncherEntry::set_count(int64_t count)
+{
+    if (count == state.count)
+        return;
+
+    state.count = count;
+    state.count_visible = count != 0;
+    queue_flush();
+}
+
+void LauncherEntry::set_progress(double progress)
+{
+    bool visible = progress >= 0.0;
+    // Docks can't draw finer than a percent, and downloads report progress on every chunk
+    progress = visible ? std::round(std::min(progress, 1.0) * PROGRESS_STEPS) / PROGRESS_STEPS : 0.0;
+
+    if (visible == state.progress_visible && progress == state.progress)
+        return;
+
+    state.progress = progress;
+    state.progress_visible = visible;
+    queue_flush();
+}
+
+void LauncherEntry::set_urgent(bool urgent)
+{
+    if (urgent == state.urgent)
+        return;
+
+    state.urgent = urgent;
+    queue_flush();
+}
+
+void LauncherEntry::queue_flush()
+{
+    if (flush_source)
+        return;
+
+    // Same shape as StatusNotifierItem::queue_update: the first change goes out right away, the rest wait
+    gint64 wait = last_flush_time + MIN_FLUSH_INTERVAL - g_get_monotonic_time();
+    if (wait <= 0)
+    {
+        flush();
+        return;
+    }
+
+    flush_source = g_timeout_source_new(static_cast<guint>((wait + 999) / 1000));
+    g_source_set_callback(flush_source, on_flush_timeout, this, nullptr);
+    g_source_attach(flush_source, context);
+}
+
+gboolean LauncherEntry::on_flush_timeout(gpointer user_data)
+{
+    auto *self = static_cast<LauncherEntry *>(user_data);
+
+    g_source_unref(self->flush_source);
+    self->flush_source = nullptr;
+    self->flush();
+
+    return G_SOURCE_REMOVE;
+}
+
+void LauncherEntry::flush()
+{
+    last_flush_time = g_get_monotonic_time();
+
+    // Unity merges partial updates, so unchanged groups are left out. A group that did change always
+    // sends its value together with its *-visible key, never one without the other.
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+    bool changed = false;
+
+    if (state.count != announced.count || state.count_visible != announced.count_visible)
+    {
+        g_variant_builder_add(&builder, "{sv}", "count", g_variant_new_int64(state.count));
+        g_variant_builder_add(&builder, "{sv}", "count-visible", g_variant_new_boolean(state.count_visible));
+        changed = true;
+    }
+    if (state.progress != announced.progress || state.progress_visible != announced.progress_visible)
+    {
+        g_variant_builder_add(&builder, "{sv}", "progress", g_variant_new_double(state.progress));
+        g_variant_builder_add(&builder, "{sv}", "progress-visible", g_variant_new_boolean(state.progress_visible));
+        changed = true;
+    }
+    if (state.urgent != announced.urgent)
+    {
+        g_variant_builder_add(&builder, "{sv}", "urgent", g_variant_new_boolean(state.urgent));
+        changed = true;
+    }
+
+    // A burst that ended where it started needs no signal at all
+    if (!changed)
+    {
+        g_variant_builder_clear(&builder);
+        return;
+    }
+
+    GError *error = nullptr;
+    GObjectPtr<GDBusConnection> bus = get_session_bus(&error);
+    if (!bus)
+    {
+        GErrorPtr error_ptr(error);
+        std::cerr << "[libvesktop::LauncherEntry] Failed to connect to session bus: "
+                  << (error_ptr ? error_ptr->message : "unknown error") << std::endl;
+        g_variant_builder_clear(&builder);
+        return;
+    }
+
+    gboolean result = g_dbus_connection_emit_signal(
+        bus.get(),
+        nullptr,
+        "/",
+        "com.canonical.Unity.LauncherEntry",
+        "Update",
+        g_variant_new("(sa{sv})", app_uri.c_str(), &builder),
+        &error);
+
+    if (!result)
+    {
+        // announced is left alone, so the next change resends these fields
+        GErrorPtr error_ptr(error);
+        std::cerr << "[libvesktop::LauncherEntry] Failed to emit Update signal: "
+                  << (error_ptr ? error_ptr->message : "unknown error") << std::endl;
+        return;
+    }
+
+    announced = state;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <gio/gio.h>
+#include <cstdint>
+#include <string>
+
+// State of one com.canonical.Unity.LauncherEntry, as shown by docks and task managers
+struct LauncherState
+{
+    int64_t count = 0;
+    bool count_visible = false;
+    double progress = 0.0;
+    bool progress_visible = false;
+    bool urgent = false;
+};
+
+// Publishes launcher entry state over Unity's Update signal. Setters that don't change anything are
+// free; the rest are coalesced so a burst of changes costs one signal carrying only the count, progress
+// or urgency that differ from what was last announced. Must be used on the thread whose main context is current.
+class LauncherEntry
+{
+public:
+    LauncherEntry();
+    ~LauncherEntry();
+
+    LauncherEntry(const LauncherEntry &) = delete;
+    LauncherEntry &operator=(const LauncherEntry &) = delete;
+
+    // 0 hides the count, -1 shows an unread indicator without a number
+    void set_count(int64_t count);
+    // Fraction in [0, 1], rounded to 1/PROGRESS_STEPS; a negative value hides the progress bar
+    void set_progress(double progress);
+    void set_urgent(bool urgent);
+
+private:
+    // Roughly one frame; changes inside a window are folded into a single signal
+    static constexpr gint64 MIN_FLUSH_INTERVAL = G_USEC_PER_SEC / 60;
+    // Progress is rounded to 1% so a download only signals when the bar would visibly move
+    static constexpr double PROGRESS_STEPS = 100.0;
+
+    std::string app_uri;
+    GMainContext *context;
+
+    LauncherState state;
+    LauncherState announced;
+
+    GSource *flush_source = nullptr;
+    gint64 last_flush_time = 0;
+
+    void queue_flush();
+    void flush();
+    static gboolean on_flush_timeout(gpointer user_data);
+};
@@ -1,4 +1,7 @@
 #include <gio/gio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <cstdint>
 #include <iostream>
@@ -10,318 +13,1668 @@
 #include <string>
 #include <vector>
 #include <cstring>
+#include "glib_ptr.h"
 #include "status_notifier_item.h"
-
-struct GVariantDeleter
+#include "pixmap.h"
+#include "session_bus.h"
+#include "main_context_thread.h"
+#include "event_ring.h"
+#include "appearance.h"
+#include "appearance_files.h"
+#include "launcher_entry.h"
+
+// Default for portal calls; the async exports let callers pick their own
+static constexpr int PORTAL_TIMEOUT_MS = 5000;
+
+std::optional<int32_t> get_accent_color(int timeout_ms = PORTAL_TIMEOUT_MS, GCancellable *cancellable = nullptr)
 {
-    void operator()(GVariant *variant) const
+    GError *error = nullptr;
+
+    GObjectPtr<GDBusConnection> bus = get_session_bus(&error);
+    if (!bus)
     {
-        if (variant)
-            g_variant_unref(variant);
+        GErrorPtr error_ptr(error);
+        std::cerr << "[libvesktop::get_accent_color] Failed to connect to session bus: "
+                  << (error_ptr ? error_ptr->message : "unknown error") << std::endl;
+        return read_appearance_from_files().accent_color;
     }
-};
 
-using GVariantPtr = std::unique_ptr<GVariant, GVariantDeleter>;
+    GVariantPtr reply(g_dbus_connection_call_sync(
+        bus.get(),
+        "org.freedesktop.portal.Desktop",
+        "/org/freedesktop/portal/desktop",
+        "org.freedesktop.portal.Settings",
+        "Read",
+        g_variant_new("(ss)", "org.freedesktop.appearance", "accent-color"),
+        nullptr,
+        G_DBUS_CALL_FLAGS_NONE,
+        timeout_ms,
+        cancellable,
+        &error));
 
-struct GErrorDeleter
-{
-    void operator()(GError *error) const
+    if (!reply)
     {
-        if (error)
-            g_error_free(error);
+        GErrorPtr error_ptr(error);
+        if (g_error_matches(error_ptr.get(), G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            return std::nullopt;
+
+        // No portal (or one without the appearance namespace); ask the desktop's own config instead
+        std::cerr << "[libvesktop::get_accent_color] Failed to call Read: "
+                  << (error_ptr ? error_ptr->message : "unknown error") << std::endl;
+        return read_appearance_from_files().accent_color;
     }
-};
 
-using GErrorPtr = std::unique_ptr<GError, GErrorDeleter>;
+    GVariant *value_raw = nullptr;
+    g_variant_get(reply.get(), "(v)", &value_raw);
+    GVariantPtr value(value_raw);
+
+    return parse_accent_color(value.get());
+}
 
-bool update_launcher_count(int count)
+bool request_background(bool autostart, const std::vector<std::string> &commandline, int timeout_ms = PORTAL_TIMEOUT_MS, GCancellable *cancellable = nullptr)
 {
     GError *error = nullptr;
 
-    const char *chromeDesktop = std::getenv("CHROME_DESKTOP");
-    std::string desktop_id = std::string("application://") + (chromeDesktop ? chromeDesktop : "vesktop.desktop");
-
-    GObjectPtr<GDBusConnection> bus(g_bus_get_sync(G_BUS_TYPE_SESSION, nullptr, &error));
+    GObjectPtr<GDBusConnection> bus = get_session_bus(&error);
     if (!bus)
     {
         GErrorPtr error_ptr(error);
-        std::cerr << "[libvesktop::update_launcher_count] Failed to connect to session bus: "
+        std::cerr << "[libvesktop::request_background] Failed to connect to session bus: "
                   << (error_ptr ? error_ptr->message : "unknown error") << std::endl;
         return false;
     }
 
     GVariantBuilder builder;
     g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
-    g_variant_builder_add(&builder, "{sv}", "count", g_variant_new_int64(count));
-    g_variant_builder_add(&builder, "{sv}", "count-visible", g_variant_new_boolean(count != 0));
+    g_variant_builder_add(&builder, "{sv}", "autostart", g_variant_new_boolean(autostart));
+
+    if (!commandline.empty())
+    {
+        GVariantBuilder cmd_builder;
+        g_variant_builder_init(&cmd_builder, G_VARIANT_TYPE("as"));
+        for (const auto &s : commandline)
+            g_variant_builder_add(&cmd_builder, "s", s.c_str());
+        g_variant_builder_add(&builder, "{sv}", "commandline", g_variant_builder_end(&cmd_builder));
+    }
 
-    gboolean result = g_dbus_connection_emit_signal(
+    GVariantPtr reply(g_dbus_connection_call_sync(
         bus.get(),
+        "org.freedesktop.portal.Desktop",
+        "/org/freedesktop/portal/desktop",
+        "org.freedesktop.portal.Background",
+        "RequestBackground",
+        g_variant_new("(sa{sv})", "", &builder),
         nullptr,
-        "/",
-        "com.canonical.Unity.LauncherEntry",
-        "Update",
-        g_variant_new("(sa{sv})", desktop_id.c_str(), &builder),
-        &error);
+        G_DBUS_CALL_FLAGS_NONE,
+        timeout_ms,
+        cancellable,
+        &error));
 
-    if (!result || error)
+    if (!reply)
     {
         GErrorPtr error_ptr(error);
-        std::cerr << "[libvesktop::update_launcher_count] Failed to emit Update signal: "
+        std::cerr << "[libvesktop::request_background] Failed to call RequestBackground: "
                   << (error_ptr ? error_ptr->message : "unknown error") << std::endl;
         return false;
     }
 
-    return true;
+    return true;
+}
+
+// Everything that listens on the bus (the tray item, the appearance monitor) lives on this thread, so
+// it keeps responding while the JS thread is busy. Calls from JS are posted there and return once queued.
+static std::unique_ptr<MainContextThread> g_dbus_thread;
+
+static MainContextThread &dbus_thread()
+{
+    if (!g_dbus_thread)
+        g_dbus_thread = std::make_unique<MainContextThread>();
+    return *g_dbus_thread;
+}
+
+// D-Bus thread only; created by the first launcher update
+static std::unique_ptr<LauncherEntry> g_launcher_entry;
+
+static void post_to_launcher(std::function<void(LauncherEntry &)> task)
+{
+    dbus_thread().post([task = std::move(task)] {
+        if (!g_launcher_entry)
+            g_launcher_entry = std::make_unique<LauncherEntry>();
+        task(*g_launcher_entry);
+    });
+}
+
+static void shutdown_launcher()
+{
+    if (!g_dbus_thread)
+        return;
+
+    g_dbus_thread->post([] {
+        g_launcher_entry.reset();
+    });
+}
+
+// Only touched on the JS thread; set while the item is initialized or initializing
+static Napi::ObjectReference g_sni_init_promise;
+// Bumped on every shutdown so a late init result can tell it is stale
+static uint32_t g_sni_generation = 0;
+
+// Only touched on the D-Bus thread
+static std::unique_ptr<StatusNotifierItem> g_sni_instance;
+
+// Only touched on the JS thread. Set once initialize() succeeds so JS can read the item's counters
+// without a round trip, and cleared before the item is destroyed.
+static StatusNotifierItem *g_sni_published = nullptr;
+
+static bool sni_started()
+{
+    return !g_sni_init_promise.IsEmpty();
+}
+
+// Runs task on the D-Bus thread; dropped if initialization failed
+static void post_to_sni(std::function<void(StatusNotifierItem &)> task)
+{
+    dbus_thread().post([task = std::move(task)] {
+        if (g_sni_instance)
+            task(*g_sni_instance);
+    });
+}
+
+// Tray events are queued on the item's thread and delivered to JS in batches, one NonBlockingCall per
+// batch, so a busy JS thread costs dropped events rather than a stalled D-Bus thread.
+struct TrayEvent
+{
+    enum class Type : uint8_t
+    {
+        MenuClick,
+        Activate,
+        SecondaryActivate,
+        ContextMenu,
+        // x and y carry the summed horizontal and vertical deltas
+        Scroll,
+        // A host is about to show the menu and is waiting on the provider
+        AboutToShow,
+    };
+
+    Type type;
+    int32_t id;
+    int32_t x;
+    int32_t y;
+    uint32_t timestamp;
+    // MenuClick only: 0 or 1 for toggle items, -1 otherwise
+    int32_t toggle_state;
+};
+
+static EventRing<TrayEvent, 256> g_tray_events;
+static std::atomic<bool> g_tray_events_scheduled{false};
+static std::atomic<uint64_t> g_tray_events_dropped{0};
+// Only touched on the D-Bus thread
+static Napi::ThreadSafeFunction g_tray_event_dispatcher;
+
+// Only touched on the JS thread
+static Napi::FunctionReference g_menu_click_callback;
+static Napi::FunctionReference g_activate_callback;
+static Napi::FunctionReference g_secondary_activate_callback;
+static Napi::FunctionReference g_context_menu_callback;
+static Napi::FunctionReference g_scroll_callback;
+static Napi::FunctionReference g_menu_provider;
+static uint64_t g_tray_events_dropped_reported = 0;
+
+static bool parse_menu_item_update(Napi::Env env, const Napi::Value &value, MenuItemUpdate &update);
+
+// Asks the provider for the menu's current contents and hands them to the item, which diffs them
+// against what hosts already have
+static void provide_menu(Napi::Env env, int32_t id)
+{
+    std::vector<MenuItemUpdate> updates;
+
+    try
+    {
+        if (!g_menu_provider.IsEmpty())
+        {
+            Napi::Value result = g_menu_provider.Call({Napi::Number::New(env, id)});
+            if (env.IsExceptionPending())
+                throw env.GetAndClearPendingException();
+
+            if (result.IsArray())
+            {
+                Napi::Array array = result.As<Napi::Array>();
+                updates.resize(array.Length());
+
+                for (uint32_t i = 0; i < array.Length(); i++)
+                {
+                    // parse_menu_item_update only leaves a TypeError pending; rethrown here so a bad entry
+                    // goes down the same path as a throwing provider and nothing stays pending after us
+                    if (!parse_menu_item_update(env, array.Get(i), updates[i]))
+                        throw env.GetAndClearPendingException();
+                }
+            }
+        }
+    }
+    catch (const Napi::Error &error)
+    {
+        // Nothing from a provider that failed partway is applied
+        std::cerr << "[libvesktop::provide_menu] Menu provider failed: " << error.Message() << std::endl;
+        updates.clear();
+    }
+
+    // Always answered, even if the provider failed or went away. Otherwise the item would keep waiting
+    // for this answer, never ask again and make every menu open wait for the timeout.
+    post_to_sni([updates = std::move(updates)](StatusNotifierItem &sni) { sni.provide_menu(updates); });
+}
+
+static void dispatch_tray_event(Napi::Env env, const TrayEvent &event)
+{
+    switch (event.type)
+    {
+    case TrayEvent::Type::MenuClick:
+        if (!g_menu_click_callback.IsEmpty())
+        {
+            Napi::Value checked = event.toggle_state < 0 ? env.Undefined() : Napi::Boolean::New(env, event.toggle_state == 1);
+            g_menu_click_callback.Call({Napi::Number::New(env, event.id), Napi::Number::New(env, event.timestamp), checked});
+        }
+        break;
+    case TrayEvent::Type::Activate:
+        if (!g_activate_callback.IsEmpty())
+            g_activate_callback.Call({Napi::Number::New(env, event.x), Napi::Number::New(env, event.y)});
+        break;
+    case TrayEvent::Type::SecondaryActivate:
+        if (!g_secondary_activate_callback.IsEmpty())
+            g_secondary_activate_callback.Call({Napi::Number::New(env, event.x), Napi::Number::New(env, event.y)});
+        break;
+    case TrayEvent::Type::ContextMenu:
+        if (!g_context_menu_callback.IsEmpty())
+            g_context_menu_callback.Call({Napi::Number::New(env, event.x), Napi::Number::New(env, event.y)});
+        break;
+    case TrayEvent::Type::Scroll:
+        if (g_scroll_callback.IsEmpty())
+            break;
+        // Same shape as the spec's Scroll(delta, orientation), one call per orientation that moved
+        if (event.y != 0)
+            g_scroll_callback.Call({Napi::Number::New(env, event.y), Napi::String::New(env, "vertical")});
+        if (event.x != 0)
+            g_scroll_callback.Call({Napi::Number::New(env, event.x), Napi::String::New(env, "horizontal")});
+        break;
+    case TrayEvent::Type::AboutToShow:
+        provide_menu(env, event.id);
+        break;
+    }
+}
+
+static void dispatch_tray_events(Napi::Env env, Napi::Function)
+{
+    // Cleared first so events pushed while we drain schedule another batch
+    g_tray_events_scheduled = false;
+
+    uint64_t dropped = g_tray_events_dropped.load();
+    if (dropped != g_tray_events_dropped_reported)
+    {
+        std::cerr << "[libvesktop::dispatch_tray_events] Dropped " << dropped - g_tray_events_dropped_reported
+                  << " tray events, the JS thread is falling behind" << std::endl;
+        g_tray_events_dropped_reported = dropped;
+    }
+
+    TrayEvent event;
+    while (g_tray_events.pop(event))
+    {
+        // A throwing callback costs only its own event; the rest of the batch has nothing else to
+        // schedule it until the next push
+        try
+        {
+            dispatch_tray_event(env, event);
+        }
+        catch (const Napi::Error &error)
+        {
+            std::cerr << "[libvesktop::dispatch_tray_events] Tray callback threw: " << error.Message() << std::endl;
+        }
+    }
+}
+
+// Called on the D-Bus thread; returns whether the event was queued
+static bool push_tray_event(const TrayEvent &event)
+{
+    if (!g_tray_events.push(event))
+    {
+        // A full ring always has a batch scheduled, so there is nothing else to do
+        g_tray_events_dropped++;
+        return false;
+    }
+
+    if (!g_tray_events_scheduled.exchange(true) && g_tray_event_dispatcher.NonBlockingCall(dispatch_tray_events) != napi_ok)
+        g_tray_events_scheduled = false;
+
+    return true;
+}
+
+// Hands a floating variant to tasks on the D-Bus thread
+static std::shared_ptr<GVariant> share_variant(GVariant *variant)
+{
+    return std::shared_ptr<GVariant>(g_variant_ref_sink(variant), g_variant_unref);
+}
+
+// Shared with the D-Bus thread, but only ever destroyed there so its subscription is dropped on the
+// context it was made on
+static std::shared_ptr<AppearanceMonitor> g_appearance;
+// Only touched on the D-Bus thread
+static Napi::ThreadSafeFunction g_appearance_callback;
+
+// The cached accent color, if the monitor has finished its initial read
+static std::optional<std::optional<int32_t>> cached_accent_color()
+{
+    if (!g_appearance)
+        return std::nullopt;
+
+    std::optional<AppearanceSettings> settings = g_appearance->get();
+    if (!settings)
+        return std::nullopt;
+
+    return settings->accent_color;
+}
+
+static void shutdown_appearance()
+{
+    if (!g_appearance)
+        return;
+
+    dbus_thread().post([monitor = std::move(g_appearance)]() mutable {
+        monitor.reset();
+
+        if (g_appearance_callback)
+        {
+            g_appearance_callback.Release();
+            g_appearance_callback = Napi::ThreadSafeFunction();
+        }
+    });
+}
+
+static void shutdown_sni()
+{
+    if (!sni_started())
+        return;
+
+    g_sni_published = nullptr;
+
+    dbus_thread().post([] {
+        g_sni_instance.reset();
+
+        // Nothing produces tray events anymore
+        if (g_tray_event_dispatcher)
+        {
+            g_tray_event_dispatcher.Release();
+            g_tray_event_dispatcher = Napi::ThreadSafeFunction();
+        }
+    });
+
+    g_sni_init_promise.Reset();
+    g_sni_generation++;
+    g_menu_click_callback.Reset();
+    g_activate_callback.Reset();
+    g_secondary_activate_callback.Reset();
+    g_context_menu_callback.Reset();
+    g_scroll_callback.Reset();
+    g_menu_provider.Reset();
+}
+
+Napi::Value updateUnityLauncherCount(Napi::CallbackInfo const &info)
+{
+    if (info.Length() < 1 || !info[0].IsNumber())
+    {
+        Napi::TypeError::New(info.Env(), "Expected (number)").ThrowAsJavaScriptException();
+        return info.Env().Undefined();
+    }
+
+    int64_t count = info[0].As<Napi::Number>().Int64Value();
+    post_to_launcher([count](LauncherEntry &entry) {
+        entry.set_count(count);
+    });
+    return Napi::Boolean::New(info.Env(), true);
+}
+
+Napi::Value SetUnityLauncherProgress(const Napi::CallbackInfo &info)
+{
+    if (info.Length() < 1 || !(info[0].IsNumber() || info[0].IsNull()))
+    {
+        Napi::TypeError::New(info.Env(), "Expected (number | null)").ThrowAsJavaScriptException();
+        return info.Env().Undefined();
+    }
+
+    // null hides the bar, which LauncherEntry spells as a negative fraction
+    double progress = info[0].IsNull() ? -1.0 : info[0].As<Napi::Number>().DoubleValue();
+    if (!info[0].IsNull() && !(progress >= 0.0 && progress <= 1.0))
+    {
+        Napi::RangeError::New(info.Env(), "progress must be between 0 and 1").ThrowAsJavaScriptException();
+        return info.Env().Undefined();
+    }
+
+    post_to_launcher([progress](LauncherEntry &entry) {
+        entry.set_progress(progress);
+    });
+    return Napi::Boolean::New(info.Env(), true);
+}
+
+Napi::Value SetUnityLauncherUrgent(const Napi::CallbackInfo &info)
+{
+    if (info.Length() < 1 || !info[0].IsBoolean())
+    {
+        Napi::TypeError::New(info.Env(), "Expected (boolean)").ThrowAsJavaScriptException();
+        return info.Env().Undefined();
+    }
+
+    bool urgent = info[0].As<Napi::Boolean>().Value();
+    post_to_launcher([urgent](LauncherEntry &entry) {
+        entry.set_urgent(urgent);
+    });
+    return Napi::Boolean::New(info.Env(), true);
+}
+
+Napi::Value getAccentColor(const Napi::CallbackInfo &info)
+{
+    auto cached = cached_accent_color();
+    auto color = cached ? *cached : get_accent_color();
+    if (color)
+        return Napi::Number::New(info.Env(), *color);
+    return info.Env().Null();
+}
+
+Napi::Value RequestBackground(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 2 || !info[0].IsBoolean() || !info[1].IsArray())
+    {
+        Napi::TypeError::New(env, "Expected (boolean, string[])").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    bool autostart = info[0].As<Napi::Boolean>();
+    Napi::Array arr = info[1].As<Napi::Array>();
+    std::vector<std::string> commandline;
+    for (uint32_t i = 0; i < arr.Length(); i++)
+    {
+        Napi::Value v = arr.Get(i);
+        if (v.IsString())
+            commandline.push_back(v.As<Napi::String>().Utf8Value());
+    }
+
+    bool ok = request_background(autostart, commandline);
+    return Napi::Boolean::New(env, ok);
+}
+
+struct PortalCallOptions
+{
+    int timeout_ms = PORTAL_TIMEOUT_MS;
+    Napi::Object signal;
+};
+
+// Parses the optional { timeout?: number, signal?: AbortSignal } argument of the async exports
+static bool parse_portal_call_options(Napi::Env env, const Napi::Value &value, PortalCallOptions &options)
+{
+    if (value.IsUndefined())
+        return true;
+
+    if (!value.IsObject())
+    {
+        Napi::TypeError::New(env, "Expected options object").ThrowAsJavaScriptException();
+        return false;
+    }
+
+    Napi::Object obj = value.As<Napi::Object>();
+    Napi::Value timeout = obj.Get("timeout");
+    Napi::Value signal = obj.Get("signal");
+
+    if (!timeout.IsUndefined())
+    {
+        if (!timeout.IsNumber() || timeout.As<Napi::Number>().DoubleValue() <= 0)
+        {
+            Napi::RangeError::New(env, "timeout must be a positive number").ThrowAsJavaScriptException();
+            return false;
+        }
+
+        options.timeout_ms = static_cast<int>(std::min(timeout.As<Napi::Number>().DoubleValue(), 600000.0));
+    }
+
+    if (!signal.IsUndefined())
+    {
+        if (!signal.IsObject() || !signal.As<Napi::Object>().Get("addEventListener").IsFunction())
+        {
+            Napi::TypeError::New(env, "signal must be an AbortSignal").ThrowAsJavaScriptException();
+            return false;
+        }
+
+        options.signal = signal.As<Napi::Object>();
+    }
+
+    return true;
+}
+
+static Napi::Value make_abort_error(Napi::Env env)
+{
+    Napi::Error error = Napi::Error::New(env, "The operation was aborted");
+    error.Value().Set("name", Napi::String::New(env, "AbortError"));
+    return error.Value();
+}
+
+// Runs a blocking portal call on the libuv thread pool and settles a promise with its result.
+// An AbortSignal cancels the in-flight D-Bus call through a GCancellable.
+class PortalCallWorker : public Napi::AsyncWorker
+{
+public:
+    PortalCallWorker(Napi::Env env, const PortalCallOptions &options)
+        : Napi::AsyncWorker(env, "libvesktop:portal"),
+          deferred(Napi::Promise::Deferred::New(env)),
+          cancellable(g_cancellable_new()),
+          timeout_ms(options.timeout_ms)
+    {
+        if (options.signal.IsEmpty())
+            return;
+
+        GCancellable *cancellable_ptr = cancellable.get();
+        Napi::Function listener = Napi::Function::New(env, [cancellable_ptr](const Napi::CallbackInfo &info) {
+            g_cancellable_cancel(cancellable_ptr);
+        });
+
+        signal = Napi::Persistent(options.signal);
+        abort_listener = Napi::Persistent(listener);
+        options.signal.Get("addEventListener").As<Napi::Function>().Call(options.signal, {Napi::String::New(env, "abort"), listener});
+    }
+
+    Napi::Promise Promise() const
+    {
+        return deferred.Promise();
+    }
+
+protected:
+    Napi::Promise::Deferred deferred;
+    GObjectPtr<GCancellable> cancellable;
+    int timeout_ms;
+
+    virtual Napi::Value Result(Napi::Env env) = 0;
+
+    void OnOK() override
+    {
+        // The listener captures our cancellable, so it must not outlive this worker
+        remove_abort_listener();
+
+        if (g_cancellable_is_cancelled(cancellable.get()))
+            deferred.Reject(make_abort_error(Env()));
+        else
+            deferred.Resolve(Result(Env()));
+    }
+
+    void OnError(const Napi::Error &error) override
+    {
+        remove_abort_listener();
+        deferred.Reject(error.Value());
+    }
+
+private:
+    Napi::ObjectReference signal;
+    Napi::FunctionReference abort_listener;
+
+    void remove_abort_listener()
+    {
+        if (signal.IsEmpty())
+            return;
+
+        Napi::Object signal_obj = signal.Value();
+        signal_obj.Get("removeEventListener").As<Napi::Function>().Call(signal_obj, {Napi::String::New(Env(), "abort"), abort_listener.Value()});
+        signal.Reset();
+        abort_listener.Reset();
+    }
+};
+
+class AccentColorWorker : public PortalCallWorker
+{
+public:
+    using PortalCallWorker::PortalCallWorker;
+
+protected:
+    void Execute() override
+    {
+        color = get_accent_color(timeout_ms, cancellable.get());
+    }
+
+    Napi::Value Result(Napi::Env env) override
+    {
+        return color ? Napi::Number::New(env, *color) : env.Null();
+    }
+
+private:
+    std::optional<int32_t> color;
+};
+
+class RequestBackgroundWorker : public PortalCallWorker
+{
+public:
+    RequestBackgroundWorker(Napi::Env env, const PortalCallOptions &options, bool autostart, std::vector<std::string> commandline)
+        : PortalCallWorker(env, options), autostart(autostart), commandline(std::move(commandline))
+    {
+    }
+
+protected:
+    void Execute() override
+    {
+        ok = request_background(autostart, commandline, timeout_ms, cancellable.get());
+    }
+
+    Napi::Value Result(Napi::Env env) override
+    {
+        return Napi::Boolean::New(env, ok);
+    }
+
+private:
+    bool autostart;
+    std::vector<std::string> commandline;
+    bool ok = false;
+};
+
+// Returns true if the signal has already fired, in which case the promise should be rejected up front
+static bool signal_aborted(const PortalCallOptions &options)
+{
+    return !options.signal.IsEmpty() && options.signal.Get("aborted").ToBoolean().Value();
+}
+
+static Napi::Value rejected_abort(Napi::Env env)
+{
+    Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+    deferred.Reject(make_abort_error(env));
+    return deferred.Promise();
+}
+
+Napi::Value GetAccentColorAsync(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    PortalCallOptions options;
+    if (!parse_portal_call_options(env, info[0], options))
+        return env.Null();
+
+    if (signal_aborted(options))
+        return rejected_abort(env);
+
+    if (auto cached = cached_accent_color())
+    {
+        Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+        deferred.Resolve(*cached ? Napi::Number::New(env, **cached) : env.Null());
+        return deferred.Promise();
+    }
+
+    auto *worker = new AccentColorWorker(env, options);
+    Napi::Promise promise = worker->Promise();
+    worker->Queue();
+
+    return promise;
+}
+
+static Napi::Value appearance_to_value(Napi::Env env, const std::optional<AppearanceSettings> &settings)
+{
+    if (!settings)
+        return env.Null();
+
+    static const char *const color_schemes[] = {"no-preference", "dark", "light"};
+    static const char *const contrasts[] = {"no-preference", "high"};
+
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("accentColor", settings->accent_color ? Napi::Number::New(env, *settings->accent_color) : env.Null());
+    result.Set("colorScheme", Napi::String::New(env, color_schemes[settings->color_scheme < 3 ? settings->color_scheme : 0]));
+    result.Set("contrast", Napi::String::New(env, contrasts[settings->contrast < 2 ? settings->contrast : 0]));
+    return result;
+}
+
+Napi::Value GetAppearance(const Napi::CallbackInfo &info)
+{
+    if (!g_appearance)
+        return info.Env().Null();
+
+    return appearance_to_value(info.Env(), g_appearance->get());
+}
+
+Napi::Value WatchAppearance(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() > 0 && !info[0].IsUndefined() && !info[0].IsFunction())
+    {
+        Napi::TypeError::New(env, "Expected (function?)").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+    Napi::ThreadSafeFunction settle = Napi::ThreadSafeFunction::New(
+        env,
+        Napi::Function::New(env, [](const Napi::CallbackInfo &) {}),
+        "WatchAppearance",
+        0,
+        1
+    );
+
+    // Change notifications must not keep the process alive on their own
+    Napi::ThreadSafeFunction callback;
+    if (info.Length() > 0 && info[0].IsFunction())
+    {
+        callback = Napi::ThreadSafeFunction::New(env, info[0].As<Napi::Function>(), "AppearanceCallback", 0, 1);
+        callback.Unref(env);
+    }
+
+    bool start = !g_appearance;
+    if (start)
+    {
+        g_appearance = std::make_shared<AppearanceMonitor>([](const AppearanceSettings &settings) {
+            if (g_appearance_callback)
+            {
+                g_appearance_callback.NonBlockingCall([settings](Napi::Env env, Napi::Function jsCallback) {
+                    jsCallback.Call({appearance_to_value(env, settings)});
+                });
+            }
+        });
+    }
+
+    dbus_thread().post([monitor = g_appearance, start, settle, deferred, callback]() mutable {
+        if (callback)
+        {
+            if (g_appearance_callback)
+                g_appearance_callback.Release();
+            g_appearance_callback = callback;
+        }
+
+        if (start)
+            monitor->start();
+
+        monitor->when_loaded([monitor, settle, deferred]() mutable {
+            settle.NonBlockingCall([monitor, deferred](Napi::Env env, Napi::Function) {
+                deferred.Resolve(appearance_to_value(env, monitor->get()));
+            });
+            settle.Release();
+        });
+    });
+
+    return deferred.Promise();
+}
+
+Napi::Value RequestBackgroundAsync(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 2 || !info[0].IsBoolean() || !info[1].IsArray())
+    {
+        Napi::TypeError::New(env, "Expected (boolean, string[], options?)").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    PortalCallOptions options;
+    if (!parse_portal_call_options(env, info[2], options))
+        return env.Null();
+
+    bool autostart = info[0].As<Napi::Boolean>();
+    Napi::Array arr = info[1].As<Napi::Array>();
+    std::vector<std::string> commandline;
+    for (uint32_t i = 0; i < arr.Length(); i++)
+    {
+        Napi::Value v = arr.Get(i);
+        if (v.IsString())
+            commandline.push_back(v.As<Napi::String>().Utf8Value());
+    }
+
+    if (signal_aborted(options))
+        return rejected_abort(env);
+
+    auto *worker = new RequestBackgroundWorker(env, options, autostart, std::move(commandline));
+    Napi::Promise promise = worker->Promise();
+    worker->Queue();
+
+    return promise;
+}
+
+struct BitmapArgs
+{
+    const uint8_t *data;
+    int width;
+    int height;
+    size_t stride;
+};
+
+static bool parse_bitmap(
+    Napi::Env env,
+    const Napi::Value &bitmap,
+    const Napi::Value &width_value,
+    const Napi::Value &height_value,
+    const Napi::Value &stride_value,
+    BitmapArgs &args)
+{
+    if (!bitmap.IsBuffer() || !width_value.IsNumber() || !height_value.IsNumber() ||
+        (!stride_value.IsUndefined() && !stride_value.IsNumber()))
+    {
+        Napi::TypeError::New(env, "Expected (Buffer, number, number, number?)").ThrowAsJavaScriptException();
+        return false;
+    }
+
+    Napi::Buffer<uint8_t> buffer = bitmap.As<Napi::Buffer<uint8_t>>();
+    int64_t width = width_value.As<Napi::Number>().Int64Value();
+    int64_t height = height_value.As<Napi::Number>().Int64Value();
+    int64_t stride = stride_value.IsNumber() ? stride_value.As<Napi::Number>().Int64Value() : width * 4;
+
+    if (width <= 0 || height <= 0 || width > 4096 || height > 4096 || stride < width * 4)
+    {
+        Napi::RangeError::New(env, "Invalid bitmap dimensions").ThrowAsJavaScriptException();
+        return false;
+    }
+
+    if (static_cast<uint64_t>(buffer.Length()) < static_cast<uint64_t>(stride * (height - 1) + width * 4))
+    {
+        Napi::RangeError::New(env, "Bitmap buffer is too small for the given dimensions").ThrowAsJavaScriptException();
+        return false;
+    }
+
+    args.data = buffer.Data();
+    args.width = static_cast<int>(width);
+    args.height = static_cast<int>(height);
+    args.stride = static_cast<size_t>(stride);
+    return true;
+}
+
+// Parses (bitmap: Buffer, width: number, height: number, stride?: number) as produced by NativeImage.toBitmap()
+static bool parse_bitmap_args(const Napi::CallbackInfo &info, BitmapArgs &args)
+{
+    return parse_bitmap(info.Env(), info[0], info[1], info[2], info[3], args);
+}
+
+// Builds the width/height-prefixed pixmap format accepted by set_icon_pixmap
+static void bitmap_to_pixmap(const BitmapArgs &args, uint8_t *out)
+{
+    int32_t width = args.width;
+    int32_t height = args.height;
+    memcpy(out, &width, 4);
+    memcpy(out + 4, &height, 4);
+    bitmap_to_argb32_premultiplied(args.data, args.stride, args.width, args.height, out + 8);
+}
+
+Napi::Value IsSessionBusConnected(const Napi::CallbackInfo &info)
+{
+    return Napi::Boolean::New(info.Env(), session_bus_connected());
+}
+
+Napi::Value BitmapToPixmap(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    BitmapArgs args;
+    if (!parse_bitmap_args(info, args))
+        return env.Null();
+
+    auto pixmap = Napi::Buffer<uint8_t>::New(env, 8 + static_cast<size_t>(args.width) * args.height * 4);
+    bitmap_to_pixmap(args, pixmap.Data());
+
+    return pixmap;
+}
+
+Napi::Value GetPixmapKernel(const Napi::CallbackInfo &info)
+{
+    return Napi::String::New(info.Env(), pixmap_kernel_name());
+}
+
+#ifdef LIBVESKTOP_TESTING
+// Times what a GetLayout reply costs for an itemCount-entry menu: rebuilding the layout every call
+// (the old behaviour), wrapping the per-revision cache, and building a visibility-only reply.
+// Used by bench.js; no D-Bus involved.
+Napi::Value BenchmarkMenuLayout(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 2 || !info[0].IsNumber() || !info[1].IsNumber())
+    {
+        Napi::TypeError::New(env, "Expected (number, number)").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    int32_t item_count = info[0].As<Napi::Number>().Int32Value();
+    int32_t iterations = info[1].As<Napi::Number>().Int32Value();
+    if (item_count < 0 || iterations <= 0)
+    {
+        Napi::RangeError::New(env, "item count and iterations must be positive").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    std::vector<MenuItem> items;
+    for (int32_t i = 0; i < item_count; i++)
+    {
+        MenuItem item;
+        item.id = i + 1;
+        item.label = "Menu item " + std::to_string(item.id);
+        item.is_separator = i % 8 == 7;
+        items.push_back(std::move(item));
+    }
+
+    MenuModel menu;
+    MenuChanges changes;
+    menu.set(items, changes);
+
+    auto time_per_reply = [iterations](auto &&reply) {
+        auto start = std::chrono::steady_clock::now();
+        for (int32_t i = 0; i < iterations; i++)
+            g_variant_unref(g_variant_ref_sink(reply()));
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() / iterations;
+    };
+
+    double rebuild = time_per_reply([&menu] {
+        return g_variant_new("(u@(ia{sv}av))", 1, menu.build_layout(MenuModel::ROOT_ID, -1));
+    });
+
+    // What a host asking only for visibility (propertyNames = ["visible"]) costs
+    double filtered = time_per_reply([&menu] {
+        return g_variant_new("(u@(ia{sv}av))", 1, menu.build_layout(MenuModel::ROOT_ID, -1, MENU_PROPERTY_VISIBLE));
+    });
+
+    GVariantPtr layout(g_variant_ref_sink(menu.build_layout(MenuModel::ROOT_ID, -1)));
+    double cached = time_per_reply([&layout] {
+        return g_variant_new("(u@(ia{sv}av))", 1, layout.get());
+    });
+
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("rebuild", Napi::Number::New(env, rebuild));
+    result.Set("cached", Napi::Number::New(env, cached));
+    result.Set("filtered", Napi::Number::New(env, filtered));
+    return result;
+}
+#endif
+
+Napi::Value InitStatusNotifierItem(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (sni_started())
+    {
+        return g_sni_init_promise.Value();
+    }
+
+    Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(env);
+    Napi::ThreadSafeFunction settle = Napi::ThreadSafeFunction::New(
+        env,
+        Napi::Function::New(env, [](const Napi::CallbackInfo &) {}),
+        "InitStatusNotifierItem",
+        0,
+        1
+    );
+
+    // Only used to hop onto the JS thread, so it must not keep the process alive on its own
+    Napi::ThreadSafeFunction dispatcher = Napi::ThreadSafeFunction::New(
+        env,
+        Napi::Function::New(env, [](const Napi::CallbackInfo &) {}),
+        "TrayEvents",
+        0,
+        1
+    );
+    dispatcher.Unref(env);
+
+    g_sni_init_promise = Napi::Persistent(static_cast<Napi::Object>(deferred.Promise()));
+
+    uint32_t generation = g_sni_generation;
+    dbus_thread().post([settle, deferred, dispatcher, generation]() mutable {
+        // Constructed here so its objects, watches and timers belong to this thread's context
+        auto item = std::make_unique<StatusNotifierItem>();
+        bool success = item->initialize();
+
+        if (success)
+        {
+            item->set_menu_click_callback([](int32_t id, uint32_t timestamp, int32_t toggle_state) {
+                push_tray_event({TrayEvent::Type::MenuClick, id, 0, 0, timestamp, toggle_state});
+            });
+            item->set_activate_callback([](int32_t x, int32_t y) {
+                push_tray_event({TrayEvent::Type::Activate, 0, x, y, 0, -1});
+            });
+            item->set_secondary_activate_callback([](int32_t x, int32_t y) {
+                push_tray_event({TrayEvent::Type::SecondaryActivate, 0, x, y, 0, -1});
+            });
+            item->set_context_menu_callback([](int32_t x, int32_t y) {
+                push_tray_event({TrayEvent::Type::ContextMenu, 0, x, y, 0, -1});
+            });
+            item->set_scroll_callback([](int32_t horizontal, int32_t vertical) {
+                push_tray_event({TrayEvent::Type::Scroll, 0, horizontal, vertical, 0, -1});
+            });
+
+            g_sni_instance = std::move(item);
+            g_tray_event_dispatcher = dispatcher;
+        }
+        else
+        {
+            dispatcher.Release();
+        }
+
+        StatusNotifierItem *published = g_sni_instance.get();
+        settle.NonBlockingCall([deferred, generation, success, published](Napi::Env env, Napi::Function) {
+            // A destroy that raced with initialization wins
+            if (generation == g_sni_generation)
+            {
+                if (success)
+                    g_sni_published = published;
+                else
+                    shutdown_sni(); // Nothing to talk to, so let a later call start over
+            }
+
+            deferred.Resolve(Napi::Boolean::New(env, success));
+        });
+        settle.Release();
+    });
+
+    return deferred.Promise();
+}
+
+Napi::Value SetStatusNotifierIcon(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsBuffer())
+    {
+        Napi::TypeError::New(env, "Expected (Buffer)").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    if (!sni_started())
+    {
+        Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    Napi::Buffer<uint8_t> buffer = info[0].As<Napi::Buffer<uint8_t>>();
+    if (buffer.Length() < 8)
+    {
+        Napi::RangeError::New(env, "Pixmap buffer is missing its width/height header").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    int32_t width, height;
+    memcpy(&width, buffer.Data(), 4);
+    memcpy(&height, buffer.Data() + 4, 4);
+
+    if (width <= 0 || height <= 0 || buffer.Length() - 8 != static_cast<size_t>(width) * height * 4)
+    {
+        Napi::RangeError::New(env, "Pixmap size does not match its header").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    std::vector<Pixmap> pixmaps;
+    pixmaps.push_back({width, height, GBytesPtr(g_bytes_new(buffer.Data() + 8, buffer.Length() - 8))});
+
+    auto pixmap = share_variant(pixmaps_to_variant(pixmaps));
+    post_to_sni([pixmap](StatusNotifierItem &sni) { sni.set_icon_pixmap(pixmap.get()); });
+
+    return Napi::Boolean::New(env, true);
+}
+
+Napi::Value SetStatusNotifierIconBitmap(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    BitmapArgs args;
+    if (!parse_bitmap_args(info, args))
+        return env.Null();
+
+    if (!sni_started())
+    {
+        Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    auto pixmaps = build_icon_pixmap_chain(args.data, args.stride, args.width, args.height);
+    auto pixmap = share_variant(pixmaps_to_variant(pixmaps));
+    post_to_sni([pixmap](StatusNotifierItem &sni) { sni.set_icon_pixmap(pixmap.get()); });
+
+    return Napi::Boolean::New(env, true);
+}
+
+Napi::Value RegisterStatusNotifierIconSlots(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsArray())
+    {
+        Napi::TypeError::New(env, "Expected (array)").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    if (!sni_started())
+    {
+        Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    Napi::Array slot_array = info[0].As<Napi::Array>();
+    std::vector<IconSlot> slots;
+    slots.reserve(slot_array.Length());
+
+    for (uint32_t i = 0; i < slot_array.Length(); i++)
+    {
+        Napi::Value slot_value = slot_array.Get(i);
+        if (!slot_value.IsObject())
+        {
+            Napi::TypeError::New(env, "Expected icon slot objects").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+
+        Napi::Object slot_obj = slot_value.As<Napi::Object>();
+
+        BitmapArgs args;
+        if (!parse_bitmap(env, slot_obj.Get("bitmap"), slot_obj.Get("width"), slot_obj.Get("height"), slot_obj.Get("stride"), args))
+            return env.Null();
+
+        Napi::Value name = slot_obj.Get("name");
+
+        IconSlot slot;
+        slot.name = name.IsString() ? name.As<Napi::String>().Utf8Value() : "";
+        slot.pixmaps = build_icon_pixmap_chain(args.data, args.stride, args.width, args.height);
+        slot.pixmap.reset(g_variant_ref_sink(pixmaps_to_variant(slot.pixmaps)));
+        slots.push_back(std::move(slot));
+    }
+
+    auto shared_slots = std::make_shared<std::vector<IconSlot>>(std::move(slots));
+    post_to_sni([shared_slots](StatusNotifierItem &sni) { sni.set_icon_slots(std::move(*shared_slots)); });
+
+    return Napi::Boolean::New(env, true);
+}
+
+Napi::Value SelectStatusNotifierIconSlot(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsNumber())
+    {
+        Napi::TypeError::New(env, "Expected (number)").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    if (!sni_started())
+    {
+        Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    int32_t index = info[0].As<Napi::Number>().Int32Value();
+    post_to_sni([index](StatusNotifierItem &sni) { sni.select_icon_slot(index); });
+
+    return Napi::Boolean::New(env, true);
+}
+
+Napi::Value SetStatusNotifierAttentionIconSlot(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsNumber())
+    {
+        Napi::TypeError::New(env, "Expected (number)").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    if (!sni_started())
+    {
+        Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    int32_t index = info[0].As<Napi::Number>().Int32Value();
+    post_to_sni([index](StatusNotifierItem &sni) { sni.set_attention_icon_slot(index); });
+
+    return Napi::Boolean::New(env, true);
+}
+
+Napi::Value SetStatusNotifierStatus(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsString())
+    {
+        Napi::TypeError::New(env, "Expected (string)").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    if (!sni_started())
+    {
+        Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    std::string status = info[0].As<Napi::String>().Utf8Value();
+    if (status != "Active" && status != "Passive" && status != "NeedsAttention")
+        return Napi::Boolean::New(env, false);
+
+    post_to_sni([status](StatusNotifierItem &sni) { sni.set_status(status); });
+
+    return Napi::Boolean::New(env, true);
+}
+
+Napi::Value SetStatusNotifierBadgeCount(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsNumber())
+    {
+        Napi::TypeError::New(env, "Expected (number)").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    if (!sni_started())
+    {
+        Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    int32_t count = info[0].As<Napi::Number>().Int32Value();
+    post_to_sni([count](StatusNotifierItem &sni) { sni.set_badge_count(count); });
+
+    return Napi::Boolean::New(env, true);
+}
+
+Napi::Value SetStatusNotifierAnimation(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (info.Length() < 1 || !info[0].IsArray() || (info.Length() > 1 && !info[1].IsUndefined() && !info[1].IsBoolean()))
+    {
+        Napi::TypeError::New(env, "Expected (array, boolean?)").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    if (!sni_started())
+    {
+        Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    Napi::Array frame_array = info[0].As<Napi::Array>();
+    bool loop = info.Length() < 2 || !info[1].IsBoolean() || info[1].As<Napi::Boolean>().Value();
+
+    std::vector<AnimationFrame> frames;
+    frames.reserve(frame_array.Length());
+
+    for (uint32_t i = 0; i < frame_array.Length(); i++)
+    {
+        Napi::Value frame_value = frame_array.Get(i);
+        if (!frame_value.IsObject())
+        {
+            Napi::TypeError::New(env, "Expected animation frame objects").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+
+        Napi::Object frame_obj = frame_value.As<Napi::Object>();
+        Napi::Value duration = frame_obj.Get("duration");
+        Napi::Value slot = frame_obj.Get("slot");
+
+        if (!duration.IsNumber() || duration.As<Napi::Number>().DoubleValue() <= 0)
+        {
+            Napi::TypeError::New(env, "Animation frames need a positive duration").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+
+        AnimationFrame frame;
+        frame.duration_ms = static_cast<guint>(std::min(duration.As<Napi::Number>().DoubleValue(), 60000.0));
+
+        if (slot.IsNumber())
+        {
+            double slot_index = slot.As<Napi::Number>().DoubleValue();
+            if (!(slot_index >= 0 && slot_index <= INT32_MAX))
+            {
+                Napi::RangeError::New(env, "Animation frame slots must be non-negative").ThrowAsJavaScriptException();
+                return env.Null();
+            }
+
+            frame.slot = static_cast<int32_t>(slot_index);
+        }
+        else
+        {
+            BitmapArgs args;
+            if (!parse_bitmap(env, frame_obj.Get("bitmap"), frame_obj.Get("width"), frame_obj.Get("height"), frame_obj.Get("stride"), args))
+                return env.Null();
+
+            auto pixmaps = build_icon_pixmap_chain(args.data, args.stride, args.width, args.height);
+            frame.icon.pixmap.reset(g_variant_ref_sink(pixmaps_to_variant(pixmaps)));
+        }
+
+        frames.push_back(std::move(frame));
+    }
+
+    auto shared_frames = std::make_shared<std::vector<AnimationFrame>>(std::move(frames));
+    post_to_sni([shared_frames, loop](StatusNotifierItem &sni) { sni.set_animation(std::move(*shared_frames), loop); });
+
+    return Napi::Boolean::New(env, true);
+}
+
+Napi::Value StopStatusNotifierAnimation(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (!sni_started())
+    {
+        Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    post_to_sni([](StatusNotifierItem &sni) { sni.stop_animation(); });
+
+    return Napi::Boolean::New(env, true);
+}
+
+Napi::Value BeginStatusNotifierUpdate(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (!sni_started())
+    {
+        Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    post_to_sni([](StatusNotifierItem &sni) { sni.begin_update(); });
+
+    return Napi::Boolean::New(env, true);
+}
+
+Napi::Value CommitStatusNotifierUpdate(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (!sni_started())
+    {
+        Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    post_to_sni([](StatusNotifierItem &sni) { sni.commit_update(); });
+
+    return Napi::Boolean::New(env, true);
 }
 
-std::optional<int32_t> get_accent_color()
+Napi::Value SetStatusNotifierTitle(const Napi::CallbackInfo &info)
 {
-    GError *error = nullptr;
+    Napi::Env env = info.Env();
 
-    GObjectPtr<GDBusConnection> bus(g_bus_get_sync(G_BUS_TYPE_SESSION, nullptr, &error));
-    if (!bus)
+    if (info.Length() < 1 || !info[0].IsString())
     {
-        GErrorPtr error_ptr(error);
-        std::cerr << "[libvesktop::get_accent_color] Failed to connect to session bus: "
-                  << (error_ptr ? error_ptr->message : "unknown error") << std::endl;
-        return std::nullopt;
+        Napi::TypeError::New(env, "Expected (string)").ThrowAsJavaScriptException();
+        return env.Null();
     }
 
-    GVariantPtr reply(g_dbus_connection_call_sync(
-        bus.get(),
-        "org.freedesktop.portal.Desktop",
-        "/org/freedesktop/portal/desktop",
-        "org.freedesktop.portal.Settings",
-        "Read",
-        g_variant_new("(ss)", "org.freedesktop.appearance", "accent-color"),
-        nullptr,
-        G_DBUS_CALL_FLAGS_NONE,
-        5000,
-        nullptr,
-        &error));
-
-    if (!reply)
+    if (!sni_started())
     {
-        GErrorPtr error_ptr(error);
-        std::cerr << "[libvesktop::get_accent_color] Failed to call Read: "
-                  << (error_ptr ? error_ptr->message : "unknown error") << std::endl;
-        return std::nullopt;
+        Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
+        return env.Null();
     }
 
-    GVariant *inner_raw = nullptr;
-    g_variant_get(reply.get(), "(v)", &inner_raw);
-    if (!inner_raw)
-    {
-        std::cerr << "[libvesktop::get_accent_color] Inner variant is null" << std::endl;
-        return std::nullopt;
-    }
+    std::string title = info[0].As<Napi::String>().Utf8Value();
+    post_to_sni([title](StatusNotifierItem &sni) { sni.set_title(title); });
 
-    GVariantPtr inner(inner_raw);
+    return Napi::Boolean::New(env, true);
+}
 
-    // Unwrap nested variants
-    while (g_variant_is_of_type(inner.get(), G_VARIANT_TYPE_VARIANT))
-    {
-        GVariant *next = g_variant_get_variant(inner.get());
-        inner.reset(next);
-    }
+// Each field is read with a single Get and checked by type, so a missing field costs one lookup rather
+// than a Has followed by a Get. Throws and returns false if an item has no numeric id.
+// depth is the level menu_array sits at, 1 for the top
+static bool parse_menu_items(Napi::Env env, const Napi::Array &menu_array, std::vector<MenuItem> &items, int depth = 1)
+{
+    uint32_t length = menu_array.Length();
+    items.reserve(length);
 
-    if (!g_variant_is_of_type(inner.get(), G_VARIANT_TYPE_TUPLE) ||
-        g_variant_n_children(inner.get()) < 3)
+    for (uint32_t i = 0; i < length; i++)
     {
-        std::cerr << "[libvesktop::get_accent_color] Inner variant is not a tuple of 3 doubles" << std::endl;
-        return std::nullopt;
-    }
-
-    double r = 0.0, g = 0.0, b = 0.0;
-    g_variant_get(inner.get(), "(ddd)", &r, &g, &b);
+        Napi::Value item_value = menu_array.Get(i);
+        if (!item_value.IsObject())
+            continue;
 
-    bool discard = false;
-    auto toInt = [&discard](double v) -> int
-    {
-        if (!std::isfinite(v) || v < 0.0 || v > 1.0)
+        Napi::Object item_obj = item_value.As<Napi::Object>();
+        Napi::Value id = item_obj.Get("id");
+        if (!id.IsNumber())
         {
-            discard = true;
-            return 0;
+            Napi::TypeError::New(env, "Expected menu items to have a numeric id").ThrowAsJavaScriptException();
+            return false;
         }
 
-        return static_cast<int>(std::round(v * 255.0));
-    };
+        MenuItem item;
+        item.id = id.As<Napi::Number>().Int32Value();
 
-    int32_t rgb = (toInt(r) << 16) | (toInt(g) << 8) | toInt(b);
-    if (discard)
-        return std::nullopt;
+        Napi::Value type = item_obj.Get("type");
+        item.is_separator = type.IsString() && type.As<Napi::String>().Utf8Value() == "separator";
 
-    return rgb;
-}
+        // Separators don't show a label, so don't bother copying one
+        Napi::Value label = item.is_separator ? Napi::Value() : item_obj.Get("label");
+        if (!label.IsEmpty() && label.IsString())
+            item.label = label.As<Napi::String>().Utf8Value();
 
-bool request_background(bool autostart, const std::vector<std::string> &commandline)
-{
-    GError *error = nullptr;
+        Napi::Value enabled = item_obj.Get("enabled");
+        if (enabled.IsBoolean())
+            item.enabled = enabled.As<Napi::Boolean>().Value();
 
-    GObjectPtr<GDBusConnection> bus(g_bus_get_sync(G_BUS_TYPE_SESSION, nullptr, &error));
-    if (!bus)
-    {
-        GErrorPtr error_ptr(error);
-        std::cerr << "[libvesktop::request_background] Failed to connect to session bus: "
-                  << (error_ptr ? error_ptr->message : "unknown error") << std::endl;
-        return false;
-    }
+        Napi::Value visible = item_obj.Get("visible");
+        if (visible.IsBoolean())
+            item.visible = visible.As<Napi::Boolean>().Value();
 
-    GVariantBuilder builder;
-    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
-    g_variant_builder_add(&builder, "{sv}", "autostart", g_variant_new_boolean(autostart));
+        Napi::Value toggle_type = item_obj.Get("toggleType");
+        if (toggle_type.IsString())
+        {
+            std::string name = toggle_type.As<Napi::String>().Utf8Value();
+            if (name == "checkmark")
+                item.toggle_type = MenuToggleType::Checkmark;
+            else if (name == "radio")
+                item.toggle_type = MenuToggleType::Radio;
+        }
 
-    if (!commandline.empty())
-    {
-        GVariantBuilder cmd_builder;
-        g_variant_builder_init(&cmd_builder, G_VARIANT_TYPE("as"));
-        for (const auto &s : commandline)
-            g_variant_builder_add(&cmd_builder, "s", s.c_str());
-        g_variant_builder_add(&builder, "{sv}", "commandline", g_variant_builder_end(&cmd_builder));
-    }
+        if (item.toggle_type != MenuToggleType::None)
+        {
+            Napi::Value checked = item_obj.Get("checked");
+            item.toggle_state = checked.IsBoolean() && checked.As<Napi::Boolean>().Value();
+        }
 
-    GVariantPtr reply(g_dbus_connection_call_sync(
-        bus.get(),
-        "org.freedesktop.portal.Desktop",
-        "/org/freedesktop/portal/desktop",
-        "org.freedesktop.portal.Background",
-        "RequestBackground",
-        g_variant_new("(sa{sv})", "", &builder),
-        nullptr,
-        G_DBUS_CALL_FLAGS_NONE,
-        5000,
-        nullptr,
-        &error));
+        Napi::Value submenu = item_obj.Get("submenu");
+        if (submenu.IsArray())
+        {
+            // Also what stops a submenu that contains itself
+            if (depth >= MenuModel::MAX_DEPTH)
+            {
+                Napi::RangeError::New(env, "Menus can't nest more than " + std::to_string(MenuModel::MAX_DEPTH) + " levels deep")
+                    .ThrowAsJavaScriptException();
+                return false;
+            }
+
+            if (!parse_menu_items(env, submenu.As<Napi::Array>(), item.children, depth + 1))
+                return false;
+        }
 
-    if (!reply)
-    {
-        GErrorPtr error_ptr(error);
-        std::cerr << "[libvesktop::request_background] Failed to call RequestBackground: "
-                  << (error_ptr ? error_ptr->message : "unknown error") << std::endl;
-        return false;
+        items.push_back(std::move(item));
     }
 
     return true;
 }
 
-static std::unique_ptr<StatusNotifierItem> g_sni_instance;
-static Napi::ThreadSafeFunction g_menu_click_callback;
-static Napi::ThreadSafeFunction g_activate_callback;
-
-Napi::Value updateUnityLauncherCount(Napi::CallbackInfo const &info)
+#ifdef LIBVESKTOP_TESTING
+// Changed properties as { id: { name: value } }, with null for a property back at its default (which
+// hosts are told to remove)
+static Napi::Object menu_changes_to_object(Napi::Env env, const MenuModel &menu, const MenuChanges &changes)
 {
-    if (info.Length() < 1 || !info[0].IsNumber())
+    Napi::Object result = Napi::Object::New(env);
+
+    for (const auto &[id, properties] : changes)
     {
-        Napi::TypeError::New(info.Env(), "Expected (number)").ThrowAsJavaScriptException();
-        return info.Env().Undefined();
+        const MenuNode *node = menu.find(id);
+        if (!node)
+            continue;
+
+        Napi::Object values = Napi::Object::New(env);
+        for (uint32_t bit = 1; bit & MENU_PROPERTIES_ALL; bit <<= 1)
+        {
+            if (!(properties & bit))
+                continue;
+
+            auto property = static_cast<MenuProperty>(bit);
+            GVariant *value = menu.property_value(*node, property);
+            Napi::Value js_value = env.Null();
+
+            if (value)
+            {
+                g_variant_ref_sink(value);
+                if (g_variant_is_of_type(value, G_VARIANT_TYPE_STRING))
+                    js_value = Napi::String::New(env, g_variant_get_string(value, nullptr));
+                else if (g_variant_is_of_type(value, G_VARIANT_TYPE_BOOLEAN))
+                    js_value = Napi::Boolean::New(env, g_variant_get_boolean(value));
+                else if (g_variant_is_of_type(value, G_VARIANT_TYPE_INT32))
+                    js_value = Napi::Number::New(env, g_variant_get_int32(value));
+                g_variant_unref(value);
+            }
+
+            values.Set(menu_property_name(property), js_value);
+        }
+
+        result.Set(std::to_string(id), values);
     }
 
-    int count = info[0].As<Napi::Number>().Int32Value();
-    bool success = update_launcher_count(count);
-    return Napi::Boolean::New(info.Env(), success);
+    return result;
 }
 
-Napi::Value getAccentColor(const Napi::CallbackInfo &info)
+static const char *menu_set_result_name(MenuSetResult result)
 {
-    auto color = get_accent_color();
-    if (color)
-        return Napi::Number::New(info.Env(), *color);
-    return info.Env().Null();
+    switch (result)
+    {
+    case MenuSetResult::Rejected:
+        return "rejected";
+    case MenuSetResult::Properties:
+        return "properties";
+    case MenuSetResult::Layout:
+        return "layout";
+    }
+
+    return "";
 }
 
-Napi::Value RequestBackground(const Napi::CallbackInfo &info)
+Napi::Value DiffMenuModel(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
-    if (info.Length() < 2 || !info[0].IsBoolean() || !info[1].IsArray())
+    if (info.Length() < 2 || !info[0].IsArray() || !info[1].IsArray())
     {
-        Napi::TypeError::New(env, "Expected (boolean, string[])").ThrowAsJavaScriptException();
+        Napi::TypeError::New(env, "Expected (array, array)").ThrowAsJavaScriptException();
         return env.Null();
     }
 
-    bool autostart = info[0].As<Napi::Boolean>();
-    Napi::Array arr = info[1].As<Napi::Array>();
-    std::vector<std::string> commandline;
-    for (uint32_t i = 0; i < arr.Length(); i++)
+    std::vector<MenuItem> current, next;
+    if (!parse_menu_items(env, info[0].As<Napi::Array>(), current) || !parse_menu_items(env, info[1].As<Napi::Array>(), next))
+        return env.Null();
+
+    MenuModel menu;
+    MenuChanges changes;
+    MenuSetResult result = menu.set(current, changes);
+    if (result != MenuSetResult::Rejected)
     {
-        Napi::Value v = arr.Get(i);
-        if (v.IsString())
-            commandline.push_back(v.As<Napi::String>().Utf8Value());
+        changes.clear();
+        result = menu.set(next, changes);
     }
 
-    bool ok = request_background(autostart, commandline);
-    return Napi::Boolean::New(env, ok);
+    Napi::Object reply = Napi::Object::New(env);
+    reply.Set("result", Napi::String::New(env, menu_set_result_name(result)));
+    reply.Set("changes", menu_changes_to_object(env, menu, changes));
+    return reply;
 }
 
-Napi::Value InitStatusNotifierItem(const Napi::CallbackInfo &info)
+Napi::Value ClickMenuModel(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
-    if (g_sni_instance)
+    if (info.Length() < 2 || !info[0].IsArray() || !info[1].IsNumber())
     {
-        return Napi::Boolean::New(env, true);
+        Napi::TypeError::New(env, "Expected (array, number)").ThrowAsJavaScriptException();
+        return env.Null();
     }
 
-    g_sni_instance = std::make_unique<StatusNotifierItem>();
-    bool success = g_sni_instance->initialize();
+    std::vector<MenuItem> items;
+    if (!parse_menu_items(env, info[0].As<Napi::Array>(), items))
+        return env.Null();
 
-    if (!success)
+    MenuModel menu;
+    MenuChanges changes;
+    if (menu.set(items, changes) == MenuSetResult::Rejected)
     {
-        g_sni_instance.reset();
-        return Napi::Boolean::New(env, false);
+        Napi::RangeError::New(env, "Menu item ids must be unique and non-zero").ThrowAsJavaScriptException();
+        return env.Null();
     }
 
-    return Napi::Boolean::New(env, true);
+    menu.toggle(info[1].As<Napi::Number>().Int32Value(), changes);
+    return menu_changes_to_object(env, menu, changes);
 }
+#endif
 
-Napi::Value SetStatusNotifierIcon(const Napi::CallbackInfo &info)
+Napi::Value SetStatusNotifierMenu(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
-    if (info.Length() < 1 || !info[0].IsBuffer())
+    if (info.Length() < 1 || !info[0].IsArray())
     {
-        Napi::TypeError::New(env, "Expected (Buffer)").ThrowAsJavaScriptException();
+        Napi::TypeError::New(env, "Expected (array)").ThrowAsJavaScriptException();
         return env.Null();
     }
 
-    if (!g_sni_instance)
+    if (!sni_started())
     {
         Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
         return env.Null();
     }
 
-    Napi::Buffer<uint8_t> buffer = info[0].As<Napi::Buffer<uint8_t>>();
-    std::vector<uint8_t> pixmap_data(buffer.Data(), buffer.Data() + buffer.Length());
+    std::vector<MenuItem> items;
+    if (!parse_menu_items(env, info[0].As<Napi::Array>(), items))
+        return env.Null();
 
-    bool success = g_sni_instance->set_icon_pixmap(pixmap_data);
+    post_to_sni([items = std::move(items)](StatusNotifierItem &sni) { sni.set_menu(items); });
 
-    return Napi::Boolean::New(env, success);
+    return Napi::Boolean::New(env, true);
 }
 
-Napi::Value SetStatusNotifierTitle(const Napi::CallbackInfo &info)
+Napi::Value UpdateStatusNotifierMenuItem(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
-    if (info.Length() < 1 || !info[0].IsString())
+    if (info.Length() < 2 || !info[0].IsNumber() || !info[1].IsString())
     {
-        Napi::TypeError::New(env, "Expected (string)").ThrowAsJavaScriptException();
+        Napi::TypeError::New(env, "Expected (number, string)").ThrowAsJavaScriptException();
         return env.Null();
     }
 
-    if (!g_sni_instance)
+    if (!sni_started())
     {
         Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
         return env.Null();
     }
 
-    std::string title = info[0].As<Napi::String>().Utf8Value();
-    bool success = g_sni_instance->set_title(title);
+    int32_t id = info[0].As<Napi::Number>().Int32Value();
+    std::string label = info[1].As<Napi::String>().Utf8Value();
+
+    post_to_sni([id, label](StatusNotifierItem &sni) { sni.update_menu_item_label(id, label); });
+
+    return Napi::Boolean::New(env, true);
+}
+
+static bool parse_menu_item_update(Napi::Env env, const Napi::Value &value, MenuItemUpdate &update)
+{
+    if (!value.IsObject() || !value.As<Napi::Object>().Get("id").IsNumber())
+    {
+        Napi::TypeError::New(env, "Expected menu item updates to be objects with a numeric id").ThrowAsJavaScriptException();
+        return false;
+    }
+
+    Napi::Object obj = value.As<Napi::Object>();
+    update.id = obj.Get("id").As<Napi::Number>().Int32Value();
 
-    return Napi::Boolean::New(env, success);
+    Napi::Value label = obj.Get("label");
+    Napi::Value enabled = obj.Get("enabled");
+    Napi::Value visible = obj.Get("visible");
+    Napi::Value checked = obj.Get("checked");
+
+    if (label.IsString())
+        update.label = label.As<Napi::String>().Utf8Value();
+    if (enabled.IsBoolean())
+        update.enabled = enabled.As<Napi::Boolean>().Value();
+    if (visible.IsBoolean())
+        update.visible = visible.As<Napi::Boolean>().Value();
+    if (checked.IsBoolean())
+        update.toggle_state = checked.As<Napi::Boolean>().Value();
+
+    return true;
 }
 
-Napi::Value SetStatusNotifierMenu(const Napi::CallbackInfo &info)
+Napi::Value UpdateStatusNotifierMenuItems(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
@@ -331,80 +1684,81 @@ Napi::Value SetStatusNotifierMenu(const Napi::CallbackInfo &info)
         return env.Null();
     }
 
-    if (!g_sni_instance)
+    if (!sni_started())
     {
         Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
         return env.Null();
     }
 
-    Napi::Array menu_array = info[0].As<Napi::Array>();
-    std::vector<MenuItem> items;
+    Napi::Array array = info[0].As<Napi::Array>();
+    std::vector<MenuItemUpdate> updates(array.Length());
 
-    for (uint32_t i = 0; i < menu_array.Length(); i++)
+    for (uint32_t i = 0; i < array.Length(); i++)
     {
-        Napi::Value item_value = menu_array.Get(i);
-        if (!item_value.IsObject())
-            continue;
-
-        Napi::Object item_obj = item_value.As<Napi::Object>();
-
-        MenuItem item;
-        item.id = item_obj.Get("id").As<Napi::Number>().Int32Value();
-        item.label = item_obj.Has("label") ? item_obj.Get("label").As<Napi::String>().Utf8Value() : "";
-        item.enabled = item_obj.Has("enabled") ? item_obj.Get("enabled").As<Napi::Boolean>().Value() : true;
-        item.visible = item_obj.Has("visible") ? item_obj.Get("visible").As<Napi::Boolean>().Value() : true;
-        item.is_separator = item_obj.Has("type") && item_obj.Get("type").As<Napi::String>().Utf8Value() == "separator";
-
-        items.push_back(item);
+        if (!parse_menu_item_update(env, array.Get(i), updates[i]))
+            return env.Null();
     }
 
-    bool success = g_sni_instance->set_menu(items);
+    post_to_sni([updates = std::move(updates)](StatusNotifierItem &sni) { sni.update_menu_items(updates); });
 
-    return Napi::Boolean::New(env, success);
+    return Napi::Boolean::New(env, true);
 }
 
-Napi::Value UpdateStatusNotifierMenuItem(const Napi::CallbackInfo &info)
+Napi::Value SetStatusNotifierUpdateRate(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
-    if (info.Length() < 2 || !info[0].IsNumber() || !info[1].IsString())
+    if (info.Length() < 1 || !info[0].IsNumber())
     {
-        Napi::TypeError::New(env, "Expected (number, string)").ThrowAsJavaScriptException();
+        Napi::TypeError::New(env, "Expected (number)").ThrowAsJavaScriptException();
         return env.Null();
     }
 
-    if (!g_sni_instance)
+    if (!sni_started())
     {
         Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
         return env.Null();
     }
 
-    int32_t id = info[0].As<Napi::Number>().Int32Value();
-    std::string label = info[1].As<Napi::String>().Utf8Value();
+    double hz = info[0].As<Napi::Number>().DoubleValue();
+    if (!std::isfinite(hz) || (hz != 0 && hz < StatusNotifierItem::MIN_UPDATE_RATE_HZ))
+    {
+        Napi::RangeError::New(env, "hz must be 0 or a finite rate of at least 0.1").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+
+    post_to_sni([hz](StatusNotifierItem &sni) { sni.set_max_update_rate(hz); });
 
-    bool success = g_sni_instance->update_menu_item_label(id, label);
+    return Napi::Boolean::New(env, true);
+}
+
+Napi::Value GetStatusNotifierStats(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    StatusNotifierItem *sni = g_sni_published;
+    if (!sni)
+        return env.Null();
+
+    UpdateStats stats = sni->get_update_stats();
 
-    return Napi::Boolean::New(env, success);
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("emitted", Napi::Number::New(env, static_cast<double>(stats.emitted)));
+    result.Set("merged", Napi::Number::New(env, static_cast<double>(stats.merged)));
+    result.Set("dropped", Napi::Number::New(env, static_cast<double>(stats.dropped)));
+    result.Set("batches", Napi::Number::New(env, static_cast<double>(stats.batches)));
+    result.Set("eventsDropped", Napi::Number::New(env, static_cast<double>(g_tray_events_dropped.load())));
+    return result;
 }
 
 Napi::Value DestroyStatusNotifierItem(const Napi::CallbackInfo &info)
 {
-    if (g_sni_instance)
-    {
-        g_sni_instance.reset();
-    }
-    if (g_menu_click_callback)
-    {
-        g_menu_click_callback.Release();
-    }
-    if (g_activate_callback)
-    {
-        g_activate_callback.Release();
-    }
+    shutdown_sni();
     return info.Env().Undefined();
 }
 
-Napi::Value SetStatusNotifierMenuClickCallback(const Napi::CallbackInfo &info)
+// Shared by the setters for callbacks fed from the tray event ring
+static Napi::Value set_tray_callback(const Napi::CallbackInfo &info, Napi::FunctionReference &callback)
 {
     Napi::Env env = info.Env();
 
@@ -414,91 +1768,136 @@ Napi::Value SetStatusNotifierMenuClickCallback(const Napi::CallbackInfo &info)
         return env.Null();
     }
 
-    if (!g_sni_instance)
+    if (!sni_started())
     {
         Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
         return env.Null();
     }
 
-    if (g_menu_click_callback)
-    {
-        g_menu_click_callback.Release();
-    }
-
-    g_menu_click_callback = Napi::ThreadSafeFunction::New(
-        env,
-        info[0].As<Napi::Function>(),
-        "MenuClickCallback",
-        0,
-        1
-    );
-
-    g_sni_instance->set_menu_click_callback([](int32_t id) {
-        if (g_menu_click_callback)
-        {
-            g_menu_click_callback.BlockingCall([id](Napi::Env env, Napi::Function jsCallback) {
-                jsCallback.Call({Napi::Number::New(env, id)});
-            });
-        }
-    });
+    callback = Napi::Persistent(info[0].As<Napi::Function>());
 
     return Napi::Boolean::New(env, true);
 }
 
+Napi::Value SetStatusNotifierMenuClickCallback(const Napi::CallbackInfo &info)
+{
+    return set_tray_callback(info, g_menu_click_callback);
+}
+
 Napi::Value SetStatusNotifierActivateCallback(const Napi::CallbackInfo &info)
+{
+    return set_tray_callback(info, g_activate_callback);
+}
+
+Napi::Value SetStatusNotifierSecondaryActivateCallback(const Napi::CallbackInfo &info)
+{
+    return set_tray_callback(info, g_secondary_activate_callback);
+}
+
+Napi::Value SetStatusNotifierContextMenuCallback(const Napi::CallbackInfo &info)
+{
+    return set_tray_callback(info, g_context_menu_callback);
+}
+
+Napi::Value SetStatusNotifierScrollCallback(const Napi::CallbackInfo &info)
+{
+    return set_tray_callback(info, g_scroll_callback);
+}
+
+Napi::Value SetStatusNotifierMenuProvider(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
 
-    if (info.Length() < 1 || !info[0].IsFunction())
+    if (info.Length() < 1 || !(info[0].IsFunction() || info[0].IsNull()))
     {
-        Napi::TypeError::New(env, "Expected (function)").ThrowAsJavaScriptException();
+        Napi::TypeError::New(env, "Expected (function | null)").ThrowAsJavaScriptException();
         return env.Null();
     }
 
-    if (!g_sni_instance)
+    if (!sni_started())
     {
         Napi::Error::New(env, "StatusNotifierItem not initialized").ThrowAsJavaScriptException();
         return env.Null();
     }
 
-    if (g_activate_callback)
+    if (info[0].IsNull())
     {
-        g_activate_callback.Release();
+        g_menu_provider.Reset();
+        post_to_sni([](StatusNotifierItem &sni) { sni.set_about_to_show_callback(nullptr); });
     }
-
-    g_activate_callback = Napi::ThreadSafeFunction::New(
-        env,
-        info[0].As<Napi::Function>(),
-        "ActivateCallback",
-        0,
-        1
-    );
-
-    g_sni_instance->set_activate_callback([]() {
-        if (g_activate_callback)
-        {
-            g_activate_callback.BlockingCall([](Napi::Env env, Napi::Function jsCallback) {
-                jsCallback.Call({});
+    else
+    {
+        g_menu_provider = Napi::Persistent(info[0].As<Napi::Function>());
+        post_to_sni([](StatusNotifierItem &sni) {
+            sni.set_about_to_show_callback([](int32_t id) {
+                return push_tray_event({TrayEvent::Type::AboutToShow, id, 0, 0, 0, -1});
             });
-        }
-    });
+        });
+    }
 
     return Napi::Boolean::New(env, true);
 }
 
+static void shutdown_libvesktop()
+{
+    shutdown_sni();
+    shutdown_appearance();
+    shutdown_launcher();
+
+    // Joins once the teardown tasks above have run
+    g_dbus_thread.reset();
+}
+
 Napi::Object Init(Napi::Env env, Napi::Object exports)
 {
     exports.Set("updateUnityLauncherCount", Napi::Function::New(env, updateUnityLauncherCount));
+    exports.Set("setUnityLauncherProgress", Napi::Function::New(env, SetUnityLauncherProgress));
+    exports.Set("setUnityLauncherUrgent", Napi::Function::New(env, SetUnityLauncherUrgent));
     exports.Set("getAccentColor", Napi::Function::New(env, getAccentColor));
     exports.Set("requestBackground", Napi::Function::New(env, RequestBackground));
+    exports.Set("getAccentColorAsync", Napi::Function::New(env, GetAccentColorAsync));
+    exports.Set("requestBackgroundAsync", Napi::Function::New(env, RequestBackgroundAsync));
+    exports.Set("getAppearance", Napi::Function::New(env, GetAppearance));
+    exports.Set("watchAppearance", Napi::Function::New(env, WatchAppearance));
+    exports.Set("isSessionBusConnected", Napi::Function::New(env, IsSessionBusConnected));
+    exports.Set("bitmapToPixmap", Napi::Function::New(env, BitmapToPixmap));
+    exports.Set("getPixmapKernel", Napi::Function::New(env, GetPixmapKernel));
     exports.Set("initStatusNotifierItem", Napi::Function::New(env, InitStatusNotifierItem));
     exports.Set("setStatusNotifierIcon", Napi::Function::New(env, SetStatusNotifierIcon));
+    exports.Set("setStatusNotifierIconBitmap", Napi::Function::New(env, SetStatusNotifierIconBitmap));
+    exports.Set("registerStatusNotifierIconSlots", Napi::Function::New(env, RegisterStatusNotifierIconSlots));
+    exports.Set("selectStatusNotifierIconSlot", Napi::Function::New(env, SelectStatusNotifierIconSlot));
+    exports.Set("setStatusNotifierAttentionIconSlot", Napi::Function::New(env, SetStatusNotifierAttentionIconSlot));
+    exports.Set("setStatusNotifierStatus", Napi::Function::New(env, SetStatusNotifierStatus));
+    exports.Set("setStatusNotifierBadgeCount", Napi::Function::New(env, SetStatusNotifierBadgeCount));
+    exports.Set("setStatusNotifierAnimation", Napi::Function::New(env, SetStatusNotifierAnimation));
+    exports.Set("stopStatusNotifierAnimation", Napi::Function::New(env, StopStatusNotifierAnimation));
+    exports.Set("beginStatusNotifierUpdate", Napi::Function::New(env, BeginStatusNotifierUpdate));
+    exports.Set("commitStatusNotifierUpdate", Napi::Function::New(env, CommitStatusNotifierUpdate));
     exports.Set("setStatusNotifierTitle", Napi::Function::New(env, SetStatusNotifierTitle));
     exports.Set("setStatusNotifierMenu", Napi::Function::New(env, SetStatusNotifierMenu));
     exports.Set("updateStatusNotifierMenuItem", Napi::Function::New(env, UpdateStatusNotifierMenuItem));
+    exports.Set("updateStatusNotifierMenuItems", Napi::Function::New(env, UpdateStatusNotifierMenuItems));
     exports.Set("setStatusNotifierMenuClickCallback", Napi::Function::New(env, SetStatusNotifierMenuClickCallback));
     exports.Set("setStatusNotifierActivateCallback", Napi::Function::New(env, SetStatusNotifierActivateCallback));
+    exports.Set("setStatusNotifierSecondaryActivateCallback", Napi::Function::New(env, SetStatusNotifierSecondaryActivateCallback));
+    exports.Set("setStatusNotifierContextMenuCallback", Napi::Function::New(env, SetStatusNotifierContextMenuCallback));
+    exports.Set("setStatusNotifierScrollCallback", Napi::Function::New(env, SetStatusNotifierScrollCallback));
+    exports.Set("setStatusNotifierMenuProvider", Napi::Function::New(env, SetStatusNotifierMenuProvider));
+    exports.Set("setStatusNotifierUpdateRate", Napi::Function::New(env, SetStatusNotifierUpdateRate));
+    exports.Set("getStatusNotifierStats", Napi::Function::New(env, GetStatusNotifierStats));
     exports.Set("destroyStatusNotifierItem", Napi::Function::New(env, DestroyStatusNotifierItem));
+
+#ifdef LIBVESKTOP_TESTING
+    // Only in the libvesktop_testing target, for test.js and bench.js
+    exports.Set("benchmarkMenuLayout", Napi::Function::New(env, BenchmarkMenuLayout));
+    exports.Set("diffMenuModel", Napi::Function::New(env, DiffMenuModel));
+    exports.Set("clickMenuModel", Napi::Function::New(env, ClickMenuModel));
+#endif
+
+    // The D-Bus thread must not outlive the environment its callbacks belong to
+    env.AddCleanupHook(shutdown_libvesktop);
+
     return exports;
 }
 
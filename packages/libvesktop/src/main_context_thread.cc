@@ -0,0 +1,100 @@
+#include "main_context_thread.h"
+
+GSourceFuncs MainContextThread::task_source_funcs = {
+    task_source_prepare,
+    task_source_check,
+    task_source_dispatch,
+    nullptr,
+    nullptr,
+    nullptr,
+};
+
+MainContextThread::MainContextThread()
+    : context(g_main_context_new()),
+      loop(g_main_loop_new(context, FALSE))
+{
+    task_source = g_source_new(&task_source_funcs, sizeof(TaskSource));
+    reinterpret_cast<TaskSource *>(task_source)->owner = this;
+    g_source_set_name(task_source, "libvesktop tasks");
+    g_source_attach(task_source, context);
+
+    thread = std::thread(&MainContextThread::run, this);
+}
+
+MainContextThread::~MainContextThread()
+{
+    // Queued behind everything posted so far, so pending work still runs
+    post([this] { g_main_loop_quit(loop); });
+    thread.join();
+
+    g_source_destroy(task_source);
+    g_source_unref(task_source);
+    g_main_loop_unref(loop);
+    g_main_context_unref(context);
+}
+
+void MainContextThread::post(std::function<void()> task)
+{
+    Task *node = new Task{std::move(task), pending.load(std::memory_order_relaxed)};
+
+    while (!pending.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+
+    // A non-empty stack means a wakeup is already on its way
+    if (!node->next)
+        g_main_context_wakeup(context);
+}
+
+void MainContextThread::run()
+{
+    g_main_context_push_thread_default(context);
+    g_main_loop_run(loop);
+
+    // Let callbacks of operations cancelled during shutdown complete
+    while (g_main_context_iteration(context, FALSE))
+    {
+    }
+
+    g_main_context_pop_thread_default(context);
+}
+
+void MainContextThread::run_pending()
+{
+    Task *stack = pending.exchange(nullptr, std::memory_order_acquire);
+
+    // Reverse into posting order
+    Task *queue = nullptr;
+    while (stack)
+    {
+        Task *next = stack->next;
+        stack->next = queue;
+        queue = stack;
+        stack = next;
+    }
+
+    while (queue)
+    {
+        Task *next = queue->next;
+        queue->run();
+        delete queue;
+        queue = next;
+    }
+}
+
+gboolean MainContextThread::task_source_prepare(GSource *source, gint *timeout)
+{
+    *timeout = -1;
+    return reinterpret_cast<TaskSource *>(source)->owner->pending.load(std::memory_order_acquire) != nullptr;
+}
+
+gboolean MainContextThread::task_source_check(GSource *source)
+{
+    return reinterpret_cast<TaskSource *>(source)->owner->pending.load(std::memory_order_acquire) != nullptr;
+}
+
+gboolean MainContextThread::task_source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+    reinterpret_cast<TaskSource *>(source)->owner->run_pending();
+    return G_SOURCE_CONTINUE;
+}
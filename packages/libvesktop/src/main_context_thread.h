@@ -0,0 +1,51 @@
+#pragma once
+
+#include <gio/gio.h>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+// A thread running its own GMainContext. D-Bus objects, name watches and async calls set up from
+// tasks on this thread dispatch here, so they keep working while the JS thread is busy.
+class MainContextThread
+{
+public:
+    MainContextThread();
+    // Runs every task posted so far, then stops and joins the thread
+    ~MainContextThread();
+
+    MainContextThread(const MainContextThread &) = delete;
+    MainContextThread &operator=(const MainContextThread &) = delete;
+
+    // Queues a task to run on the thread. Lock-free and safe to call from any thread; tasks run in
+    // the order they were posted.
+    void post(std::function<void()> task);
+
+private:
+    struct Task
+    {
+        std::function<void()> run;
+        Task *next;
+    };
+
+    struct TaskSource
+    {
+        GSource source;
+        MainContextThread *owner;
+    };
+
+    // Treiber stack of pending tasks, newest first; the thread takes the whole stack at once
+    std::atomic<Task *> pending{nullptr};
+    GMainContext *context;
+    GMainLoop *loop;
+    GSource *task_source;
+    std::thread thread;
+
+    static GSourceFuncs task_source_funcs;
+    static gboolean task_source_prepare(GSource *source, gint *timeout);
+    static gboolean task_source_check(GSource *source);
+    static gboolean task_source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data);
+
+    void run();
+    void run_pending();
+};
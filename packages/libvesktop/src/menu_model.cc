@@ -0,0 +1,338 @@
+#include "menu_model.h"
+
+const char *menu_property_name(MenuProperty property)
+{
+    switch (property)
+    {
+    case MENU_PROPERTY_TYPE:
+        return "type";
+    case MENU_PROPERTY_LABEL:
+        return "label";
+    case MENU_PROPERTY_ENABLED:
+        return "enabled";
+    case MENU_PROPERTY_VISIBLE:
+        return "visible";
+    case MENU_PROPERTY_CHILDREN_DISPLAY:
+        return "children-display";
+    case MENU_PROPERTY_TOGGLE_TYPE:
+        return "toggle-type";
+    case MENU_PROPERTY_TOGGLE_STATE:
+        return "toggle-state";
+    }
+
+    return "";
+}
+
+uint32_t menu_property_from_name(const char *name)
+{
+    for (uint32_t bit = 1; bit & MENU_PROPERTIES_ALL; bit <<= 1)
+    {
+        if (g_strcmp0(name, menu_property_name(static_cast<MenuProperty>(bit))) == 0)
+            return bit;
+    }
+
+    return 0;
+}
+
+uint32_t menu_property_mask(GVariant *names)
+{
+    if (g_variant_n_children(names) == 0)
+        return MENU_PROPERTIES_ALL;
+
+    uint32_t mask = 0;
+    GVariantIter iter;
+    const gchar *name;
+
+    g_variant_iter_init(&iter, names);
+    while (g_variant_iter_next(&iter, "&s", &name))
+        mask |= menu_property_from_name(name);
+
+    return mask;
+}
+
+GVariant *menu_property_default(MenuProperty property)
+{
+    switch (property)
+    {
+    case MENU_PROPERTY_TYPE:
+        return g_variant_new_string("standard");
+    case MENU_PROPERTY_LABEL:
+    case MENU_PROPERTY_CHILDREN_DISPLAY:
+    case MENU_PROPERTY_TOGGLE_TYPE:
+        return g_variant_new_string("");
+    case MENU_PROPERTY_ENABLED:
+    case MENU_PROPERTY_VISIBLE:
+        return g_variant_new_boolean(TRUE);
+    case MENU_PROPERTY_TOGGLE_STATE:
+        return g_variant_new_int32(-1);
+    }
+
+    return nullptr;
+}
+
+MenuModel::MenuModel()
+{
+    nodes[ROOT_ID];
+}
+
+// Properties whose values may differ between two versions of the same item; over-reporting only costs
+// a redundant value in ItemsPropertiesUpdated
+static uint32_t changed_properties(const MenuItem &a, const MenuItem &b)
+{
+    uint32_t changed = 0;
+
+    if (a.is_separator != b.is_separator)
+        changed |= MENU_PROPERTY_TYPE | MENU_PROPERTY_LABEL;
+    if (a.label != b.label)
+        changed |= MENU_PROPERTY_LABEL;
+    if (a.enabled != b.enabled)
+        changed |= MENU_PROPERTY_ENABLED;
+    if (a.visible != b.visible)
+        changed |= MENU_PROPERTY_VISIBLE;
+    if (a.toggle_type != b.toggle_type)
+        changed |= MENU_PROPERTY_TOGGLE_TYPE | MENU_PROPERTY_TOGGLE_STATE;
+    if (a.toggle_state != b.toggle_state)
+        changed |= MENU_PROPERTY_TOGGLE_STATE;
+
+    return changed;
+}
+
+MenuSetResult MenuModel::set(const std::vector<MenuItem> &items, MenuChanges &changes)
+{
+    std::unordered_map<int32_t, MenuNode> next;
+    next[ROOT_ID];
+
+    if (!add_items(next, items, ROOT_ID, 1))
+        return MenuSetResult::Rejected;
+
+    // Equal sizes plus every new id being known means the id sets match
+    bool same_layout = next.size() == nodes.size();
+    for (auto it = next.begin(); same_layout && it != next.end(); ++it)
+    {
+        const MenuNode *current = find(it->first);
+        same_layout = current && current->parent == it->second.parent && current->children == it->second.children;
+    }
+
+    if (!same_layout)
+    {
+        nodes = std::move(next);
+        return MenuSetResult::Layout;
+    }
+
+    for (auto &[id, node] : next)
+    {
+        if (uint32_t changed = changed_properties(nodes.at(id).item, node.item))
+            changes[id] |= changed;
+    }
+
+    nodes = std::move(next);
+    return MenuSetResult::Properties;
+}
+
+bool MenuModel::add_items(std::unordered_map<int32_t, MenuNode> &nodes, const std::vector<MenuItem> &items, int32_t parent, int depth)
+{
+    if (depth > MAX_DEPTH && !items.empty())
+        return false;
+
+    for (const auto &item : items)
+    {
+        auto [it, inserted] = nodes.try_emplace(item.id);
+        if (!inserted)
+            return false;
+
+        MenuNode &node = it->second;
+        node.item.id = item.id;
+        node.item.label = item.label;
+        node.item.enabled = item.enabled;
+        node.item.visible = item.visible;
+        node.item.is_separator = item.is_separator;
+        node.item.toggle_type = item.toggle_type;
+        node.item.toggle_state = item.toggle_state;
+        node.parent = parent;
+        nodes[parent].children.push_back(item.id);
+
+        if (!add_items(nodes, item.children, item.id, depth + 1))
+            return false;
+    }
+
+    return true;
+}
+
+const MenuNode *MenuModel::find(int32_t id) const
+{
+    auto it = nodes.find(id);
+    return it != nodes.end() ? &it->second : nullptr;
+}
+
+MenuNode *MenuModel::find(int32_t id)
+{
+    auto it = nodes.find(id);
+    return it != nodes.end() ? &it->second : nullptr;
+}
+
+std::vector<int32_t> MenuModel::ids() const
+{
+    std::vector<int32_t> result;
+    result.reserve(nodes.size());
+    collect_ids(ROOT_ID, result);
+    return result;
+}
+
+void MenuModel::collect_ids(int32_t id, std::vector<int32_t> &ids) const
+{
+    ids.push_back(id);
+
+    for (int32_t child : nodes.at(id).children)
+        collect_ids(child, ids);
+}
+
+bool MenuModel::update(const MenuItemUpdate &update, MenuChanges &changes)
+{
+    MenuNode *node = find(update.id);
+    if (!node || update.id == ROOT_ID)
+        return false;
+
+    MenuItem &item = node->item;
+    uint32_t changed = 0;
+
+    if (update.label && *update.label != item.label)
+    {
+        item.label = *update.label;
+        changed |= MENU_PROPERTY_LABEL;
+    }
+    if (update.enabled && *update.enabled != item.enabled)
+    {
+        item.enabled = *update.enabled;
+        changed |= MENU_PROPERTY_ENABLED;
+    }
+    if (update.visible && *update.visible != item.visible)
+    {
+        item.visible = *update.visible;
+        changed |= MENU_PROPERTY_VISIBLE;
+    }
+
+    if (changed)
+        changes[update.id] |= changed;
+
+    bool toggled = update.toggle_state && item.toggle_type != MenuToggleType::None &&
+                   set_toggle_state(*node, *update.toggle_state, changes);
+
+    return changed || toggled;
+}
+
+bool MenuModel::toggle(int32_t id, MenuChanges &changes)
+{
+    MenuNode *node = find(id);
+    if (!node || !node->item.enabled)
+        return false;
+
+    switch (node->item.toggle_type)
+    {
+    case MenuToggleType::Checkmark:
+        return set_toggle_state(*node, !node->item.toggle_state, changes);
+    case MenuToggleType::Radio:
+        return set_toggle_state(*node, true, changes);
+    case MenuToggleType::None:
+        break;
+    }
+
+    return false;
+}
+
+bool MenuModel::set_toggle_state(MenuNode &node, bool state, MenuChanges &changes)
+{
+    bool changed = false;
+
+    if (node.item.toggle_type == MenuToggleType::Radio && state)
+    {
+        for (int32_t sibling_id : find(node.parent)->children)
+        {
+            MenuItem &sibling = find(sibling_id)->item;
+            if (sibling_id == node.item.id || sibling.toggle_type != MenuToggleType::Radio || !sibling.toggle_state)
+                continue;
+
+            sibling.toggle_state = false;
+            changes[sibling_id] |= MENU_PROPERTY_TOGGLE_STATE;
+            changed = true;
+        }
+    }
+
+    if (node.item.toggle_state != state)
+    {
+        node.item.toggle_state = state;
+        changes[node.item.id] |= MENU_PROPERTY_TOGGLE_STATE;
+        changed = true;
+    }
+
+    return changed;
+}
+
+GVariant *MenuModel::property_value(const MenuNode &node, MenuProperty property) const
+{
+    const MenuItem &item = node.item;
+
+    // The root carries nothing but children-display
+    if (item.id == ROOT_ID && property != MENU_PROPERTY_CHILDREN_DISPLAY)
+        return nullptr;
+
+    switch (property)
+    {
+    case MENU_PROPERTY_TYPE:
+        return item.is_separator ? g_variant_new_string("separator") : nullptr;
+    case MENU_PROPERTY_LABEL:
+        return !item.is_separator && !item.label.empty() ? g_variant_new_string(item.label.c_str()) : nullptr;
+    case MENU_PROPERTY_ENABLED:
+        return !item.enabled ? g_variant_new_boolean(FALSE) : nullptr;
+    case MENU_PROPERTY_VISIBLE:
+        return !item.visible ? g_variant_new_boolean(FALSE) : nullptr;
+    case MENU_PROPERTY_CHILDREN_DISPLAY:
+        return !node.children.empty() || item.id == ROOT_ID ? g_variant_new_string("submenu") : nullptr;
+    case MENU_PROPERTY_TOGGLE_TYPE:
+        if (item.toggle_type == MenuToggleType::Checkmark)
+            return g_variant_new_string("checkmark");
+        if (item.toggle_type == MenuToggleType::Radio)
+            return g_variant_new_string("radio");
+        return nullptr;
+    case MENU_PROPERTY_TOGGLE_STATE:
+        return item.toggle_type != MenuToggleType::None ? g_variant_new_int32(item.toggle_state ? 1 : 0) : nullptr;
+    }
+
+    return nullptr;
+}
+
+GVariant *MenuModel::build_properties(const MenuNode &node, uint32_t mask) const
+{
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+
+    for (uint32_t bit = 1; bit & MENU_PROPERTIES_ALL; bit <<= 1)
+    {
+        if (!(mask & bit))
+            continue;
+
+        auto property = static_cast<MenuProperty>(bit);
+        if (GVariant *value = property_value(node, property))
+            g_variant_builder_add(&builder, "{sv}", menu_property_name(property), value);
+    }
+
+    return g_variant_builder_end(&builder);
+}
+
+GVariant *MenuModel::build_layout(int32_t parent_id, int32_t depth, uint32_t mask) const
+{
+    const MenuNode *node = find(parent_id);
+    if (!node)
+        return nullptr;
+
+    GVariantBuilder children;
+    g_variant_builder_init(&children, G_VARIANT_TYPE("av"));
+
+    // Per the spec, a depth of 0 asks for the node alone and -1 for everything below it
+    if (depth != 0)
+    {
+        for (int32_t child : node->children)
+            g_variant_builder_add(&children, "v", build_layout(child, depth < 0 ? -1 : depth - 1, mask));
+    }
+
+    return g_variant_new("(i@a{sv}@av)", parent_id, build_properties(*node, mask), g_variant_builder_end(&children));
+}
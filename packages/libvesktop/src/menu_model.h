@@ -0,0 +1,132 @@
+#pragma once
+
+#include <gio/gio.h>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum class MenuToggleType : uint8_t
+{
+    None,
+    Checkmark,
+    // Radio items under the same parent form one group; turning one on turns the others off
+    Radio,
+};
+
+// One dbusmenu entry as JS describes it
+struct MenuItem
+{
+    int32_t id = 0;
+    std::string label;
+    bool enabled = true;
+    bool visible = true;
+    bool is_separator = false;
+    MenuToggleType toggle_type = MenuToggleType::None;
+    bool toggle_state = false;
+    // Entries of this item's submenu, if it has one
+    std::vector<MenuItem> children;
+};
+
+// A partial change to one item; unset fields are left alone
+struct MenuItemUpdate
+{
+    int32_t id = 0;
+    std::optional<std::string> label;
+    std::optional<bool> enabled;
+    std::optional<bool> visible;
+    std::optional<bool> toggle_state;
+};
+
+// dbusmenu properties, as bits so a set of them fits in a mask
+enum MenuProperty : uint32_t
+{
+    MENU_PROPERTY_TYPE = 1 << 0,
+    MENU_PROPERTY_LABEL = 1 << 1,
+    MENU_PROPERTY_ENABLED = 1 << 2,
+    MENU_PROPERTY_VISIBLE = 1 << 3,
+    MENU_PROPERTY_CHILDREN_DISPLAY = 1 << 4,
+    MENU_PROPERTY_TOGGLE_TYPE = 1 << 5,
+    MENU_PROPERTY_TOGGLE_STATE = 1 << 6,
+};
+constexpr uint32_t MENU_PROPERTIES_ALL = (1 << 7) - 1;
+
+// MenuProperty bits changed per item id
+using MenuChanges = std::map<int32_t, uint32_t>;
+
+// Name of a single MenuProperty on the wire
+const char *menu_property_name(MenuProperty property);
+// The MenuProperty called name, or 0 if we don't have one by that name
+uint32_t menu_property_from_name(const char *name);
+// Mask for a dbusmenu propertyNames argument (`as`); per the spec an empty list asks for everything
+uint32_t menu_property_mask(GVariant *names);
+// The value hosts assume when a property is left out. The result is floating.
+GVariant *menu_property_default(MenuProperty property);
+
+// What MenuModel::set() did to the tree
+enum class MenuSetResult : uint8_t
+{
+    // Bad ids or nesting deeper than MenuModel::MAX_DEPTH; the model is untouched
+    Rejected,
+    // Every item kept its place, so the changed properties (if any) were all that changed
+    Properties,
+    // Items were added, removed or moved; hosts need the layout again
+    Layout,
+};
+
+// An item's place in a MenuModel. item.children is always empty; the tree lives in `children`.
+struct MenuNode
+{
+    MenuItem item;
+    int32_t parent = 0;
+    std::vector<int32_t> children;
+};
+
+// The dbusmenu tree, rooted at id 0 and indexed by id so hosts asking about a handful of items
+// (GetGroupProperties, property updates) don't cost a walk over the whole menu.
+class MenuModel
+{
+public:
+    static constexpr int32_t ROOT_ID = 0;
+    // Menu levels, counting the top one. Bounds the recursion here and keeps GetLayout replies well
+    // inside D-Bus's container nesting limit.
+    static constexpr int MAX_DEPTH = 8;
+
+    MenuModel();
+
+    // Replaces the whole tree, diffing it against the current one by id. For a Properties result, the
+    // properties that differ are added to changes. Fails without touching the model if an item uses id 0,
+    // an id is repeated or submenus nest deeper than MAX_DEPTH.
+    MenuSetResult set(const std::vector<MenuItem> &items, MenuChanges &changes);
+
+    const MenuNode *find(int32_t id) const;
+    MenuNode *find(int32_t id);
+
+    // Every id in the tree, root first, in menu order
+    std::vector<int32_t> ids() const;
+
+    // Applies update, adding every property it changed to changes (turning a radio item on touches its
+    // siblings too). Returns whether anything changed; unknown ids and the root are ignored.
+    bool update(const MenuItemUpdate &update, MenuChanges &changes);
+    // What a click does to a toggle item: checkmarks flip, radio items turn on. Returns whether
+    // anything changed; disabled items and items without a toggle type are left alone.
+    bool toggle(int32_t id, MenuChanges &changes);
+
+    // Serializes the subtree at parent_id as `(ia{sv}av)`, descending depth levels (-1 for all) and
+    // including only the properties in mask. The result is floating; nullptr if parent_id isn't in the menu.
+    GVariant *build_layout(int32_t parent_id, int32_t depth, uint32_t mask = MENU_PROPERTIES_ALL) const;
+    // The properties in mask as a floating `a{sv}`. Values at their dbusmenu default are left out,
+    // as the spec allows, which keeps replies small.
+    GVariant *build_properties(const MenuNode &node, uint32_t mask = MENU_PROPERTIES_ALL) const;
+    // Value of one property, or nullptr if it is at its default. The result is floating.
+    GVariant *property_value(const MenuNode &node, MenuProperty property) const;
+
+private:
+    std::unordered_map<int32_t, MenuNode> nodes;
+
+    static bool add_items(std::unordered_map<int32_t, MenuNode> &nodes, const std::vector<MenuItem> &items, int32_t parent, int depth);
+    void collect_ids(int32_t id, std::vector<int32_t> &ids) const;
+    bool set_toggle_state(MenuNode &node, bool state, MenuChanges &changes);
+};
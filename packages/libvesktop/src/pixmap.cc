@@ -0,0 +1,507 @@
+#include "pixmap.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LIBVESKTOP_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define LIBVESKTOP_NEON 1
+#endif
+
+// Every kernel computes round(c * a / 255) as (t + (t >> 8)) >> 8 with t = c * a + 128, which is
+// exact for all 8-bit inputs and therefore bit-identical to the Math.round() loop it replaces.
+
+using ConvertRowFn = void (*)(const uint8_t *src, uint8_t *dst, int pixels);
+
+static inline uint8_t premultiply(uint8_t c, uint8_t a)
+{
+    uint32_t t = static_cast<uint32_t>(c) * a + 128;
+    return static_cast<uint8_t>((t + (t >> 8)) >> 8);
+}
+
+static void convert_row_scalar(const uint8_t *src, uint8_t *dst, int pixels)
+{
+    for (int i = 0; i < pixels; i++, src += 4, dst += 4)
+    {
+        uint8_t a = src[3];
+        dst[0] = a;
+        dst[1] = premultiply(src[2], a);
+        dst[2] = premultiply(src[1], a);
+        dst[3] = premultiply(src[0], a);
+    }
+}
+
+#ifdef LIBVESKTOP_X86
+
+// Premultiplies two unpacked BGRA pixels (one per 64-bit half) and reorders them to ARGB.
+static inline __m128i premultiply_unpacked_sse2(__m128i px)
+{
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i alpha_mask = _mm_set_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(px, alpha), bias);
+    t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    t = _mm_shufflehi_epi16(_mm_shufflelo_epi16(t, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+
+    return _mm_or_si128(_mm_andnot_si128(alpha_mask, t), _mm_and_si128(alpha_mask, alpha));
+}
+
+static void convert_row_sse2(const uint8_t *src, uint8_t *dst, int pixels)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i + 4 <= pixels; i += 4, src += 16, dst += 16)
+    {
+        __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+        __m128i lo = premultiply_unpacked_sse2(_mm_unpacklo_epi8(px, zero));
+        __m128i hi = premultiply_unpacked_sse2(_mm_unpackhi_epi8(px, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_packus_epi16(lo, hi));
+    }
+
+    convert_row_scalar(src, dst, pixels - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i premultiply_unpacked_avx2(__m256i px)
+{
+    const __m256i bias = _mm256_set1_epi16(128);
+    const __m256i alpha_mask = _mm256_set_epi16(0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1);
+
+    __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(px, alpha), bias);
+    t = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+    t = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(t, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+
+    return _mm256_blendv_epi8(t, alpha, alpha_mask);
+}
+
+__attribute__((target("avx2"))) static void convert_row_avx2(const uint8_t *src, uint8_t *dst, int pixels)
+{
+    const __m256i zero = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i + 8 <= pixels; i += 8, src += 32, dst += 32)
+    {
+        // unpack and pack both work per 128-bit lane, so pixel order survives the round trip
+        __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+        __m256i lo = premultiply_unpacked_avx2(_mm256_unpacklo_epi8(px, zero));
+        __m256i hi = premultiply_unpacked_avx2(_mm256_unpackhi_epi8(px, zero));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), _mm256_packus_epi16(lo, hi));
+    }
+
+    convert_row_sse2(src, dst, pixels - i);
+}
+
+#endif
+
+#ifdef LIBVESKTOP_NEON
+
+static inline uint8x16_t premultiply_neon(uint8x16_t c, uint8x16_t a)
+{
+    uint16x8_t lo = vmull_u8(vget_low_u8(c), vget_low_u8(a));
+    uint16x8_t hi = vmull_u8(vget_high_u8(c), vget_high_u8(a));
+
+    // (x + ((x + 128) >> 8) + 128) >> 8, the same rounding as premultiply()
+    return vcombine_u8(vraddhn_u16(lo, vrshrq_n_u16(lo, 8)), vraddhn_u16(hi, vrshrq_n_u16(hi, 8)));
+}
+
+static void convert_row_neon(const uint8_t *src, uint8_t *dst, int pixels)
+{
+    int i = 0;
+    for (; i + 16 <= pixels; i += 16, src += 64, dst += 64)
+    {
+        uint8x16x4_t px = vld4q_u8(src);
+        uint8x16x4_t out;
+        out.val[0] = px.val[3];
+        out.val[1] = premultiply_neon(px.val[2], px.val[3]);
+        out.val[2] = premultiply_neon(px.val[1], px.val[3]);
+        out.val[3] = premultiply_neon(px.val[0], px.val[3]);
+        vst4q_u8(dst, out);
+    }
+
+    convert_row_scalar(src, dst, pixels - i);
+}
+
+#endif
+
+struct ConvertKernel
+{
+    ConvertRowFn fn;
+    const char *name;
+};
+
+static ConvertKernel select_kernel()
+{
+#if defined(LIBVESKTOP_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return {convert_row_avx2, "avx2"};
+    if (__builtin_cpu_supports("sse2"))
+        return {convert_row_sse2, "sse2"};
+#elif defined(LIBVESKTOP_NEON)
+    // NEON is mandatory on AArch64
+    return {convert_row_neon, "neon"};
+#endif
+    return {convert_row_scalar, "scalar"};
+}
+
+static const ConvertKernel &kernel()
+{
+    static const ConvertKernel selected = select_kernel();
+    return selected;
+}
+
+void bitmap_to_argb32_premultiplied(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *dst)
+{
+    ConvertRowFn convert_row = kernel().fn;
+
+    for (int y = 0; y < height; y++)
+    {
+        convert_row(src, dst, width);
+        src += src_stride;
+        dst += static_cast<size_t>(width) * 4;
+    }
+}
+
+const char *pixmap_kernel_name()
+{
+    return kernel().name;
+}
+
+namespace
+{
+    constexpr int WEIGHT_BITS = 14;
+    constexpr int32_t WEIGHT_ONE = 1 << WEIGHT_BITS;
+    // Bits of extra precision kept in the intermediate buffer between the two passes
+    constexpr int INTERMEDIATE_BITS = 8;
+
+    struct Contribution
+    {
+        int first;
+        int count;
+        size_t weights_offset;
+    };
+
+    struct ScaleTable
+    {
+        std::vector<Contribution> contributions;
+        std::vector<int32_t> weights;
+    };
+
+    // For every destination pixel, the source pixels it covers and their share of its area in fixed point.
+    ScaleTable build_scale_table(int src_size, int dst_size)
+    {
+        ScaleTable table;
+        table.contributions.reserve(dst_size);
+
+        double scale = static_cast<double>(src_size) / dst_size;
+
+        for (int i = 0; i < dst_size; i++)
+        {
+            double start = i * scale;
+            double end = std::min((i + 1) * scale, static_cast<double>(src_size));
+            int first = static_cast<int>(std::floor(start));
+            int last = std::min(static_cast<int>(std::ceil(end)), src_size);
+
+            Contribution contribution{first, last - first, table.weights.size()};
+
+            int32_t total = 0;
+            size_t largest = table.weights.size();
+            for (int j = first; j < last; j++)
+            {
+                double coverage = std::min(end, j + 1.0) - std::max(start, static_cast<double>(j));
+                auto weight = static_cast<int32_t>(std::lround(coverage / (end - start) * WEIGHT_ONE));
+                table.weights.push_back(weight);
+                total += weight;
+
+                if (weight > table.weights[largest])
+                    largest = table.weights.size() - 1;
+            }
+
+            // Rounding must not change the overall brightness, so the biggest tap absorbs the error
+            table.weights[largest] += WEIGHT_ONE - total;
+            table.contributions.push_back(contribution);
+        }
+
+        return table;
+    }
+}
+
+void scale_argb32(const uint8_t *src, int src_width, int src_height, uint8_t *dst, int dst_width, int dst_height)
+{
+    ScaleTable columns = build_scale_table(src_width, dst_width);
+    ScaleTable rows = build_scale_table(src_height, dst_height);
+
+    // Horizontal pass: src_height x dst_width, each channel kept with INTERMEDIATE_BITS of fraction
+    std::vector<uint16_t> intermediate(static_cast<size_t>(src_height) * dst_width * 4);
+
+    for (int y = 0; y < src_height; y++)
+    {
+        const uint8_t *src_row = src + static_cast<size_t>(y) * src_width * 4;
+        uint16_t *out = intermediate.data() + static_cast<size_t>(y) * dst_width * 4;
+
+        for (const auto &c : columns.contributions)
+        {
+            uint32_t acc[4] = {0, 0, 0, 0};
+            const uint8_t *px = src_row + static_cast<size_t>(c.first) * 4;
+            const int32_t *weight = columns.weights.data() + c.weights_offset;
+
+            for (int k = 0; k < c.count; k++, px += 4)
+            {
+                for (int ch = 0; ch < 4; ch++)
+                    acc[ch] += px[ch] * static_cast<uint32_t>(weight[k]);
+            }
+
+            constexpr int shift = WEIGHT_BITS - INTERMEDIATE_BITS;
+            for (int ch = 0; ch < 4; ch++)
+                *out++ = static_cast<uint16_t>((acc[ch] + (1u << (shift - 1))) >> shift);
+        }
+    }
+
+    // Vertical pass straight into the destination
+    for (int y = 0; y < dst_height; y++)
+    {
+        const auto &c = rows.contributions[y];
+        const int32_t *weight = rows.weights.data() + c.weights_offset;
+        uint8_t *out = dst + static_cast<size_t>(y) * dst_width * 4;
+
+        for (int x = 0; x < dst_width * 4; x++)
+        {
+            uint32_t acc = 0;
+            const uint16_t *px = intermediate.data() + static_cast<size_t>(c.first) * dst_width * 4 + x;
+
+            for (int k = 0; k < c.count; k++, px += static_cast<size_t>(dst_width) * 4)
+                acc += *px * static_cast<uint32_t>(weight[k]);
+
+            constexpr int shift = WEIGHT_BITS + INTERMEDIATE_BITS;
+            out[x] = static_cast<uint8_t>(std::min<uint32_t>((acc + (1u << (shift - 1))) >> shift, 255));
+        }
+    }
+}
+
+std::vector<Pixmap> build_icon_pixmap_chain(const uint8_t *bitmap, size_t stride, int width, int height)
+{
+    size_t source_size = static_cast<size_t>(width) * height * 4;
+    auto *source = static_cast<uint8_t *>(g_malloc(source_size));
+    bitmap_to_argb32_premultiplied(bitmap, stride, width, height, source);
+    GBytesPtr source_bytes(g_bytes_new_take(source, source_size));
+
+    std::vector<Pixmap> chain;
+    chain.reserve(std::size(ICON_PIXMAP_SIZES));
+
+    for (int size : ICON_PIXMAP_SIZES)
+    {
+        if (size == width && size == height)
+        {
+            chain.push_back({size, size, GBytesPtr(g_bytes_ref(source_bytes.get()))});
+            continue;
+        }
+
+        // The longer side fills the square and the other keeps the source's aspect ratio
+        int fit_width = width >= height ? size : std::max(1, static_cast<int>(std::lround(static_cast<double>(size) * width / height)));
+        int fit_height = height >= width ? size : std::max(1, static_cast<int>(std::lround(static_cast<double>(size) * height / width)));
+
+        size_t scaled_size = static_cast<size_t>(size) * size * 4;
+        uint8_t *scaled;
+
+        if (fit_width == size && fit_height == size)
+        {
+            scaled = static_cast<uint8_t *>(g_malloc(scaled_size));
+            scale_argb32(source, width, height, scaled, size, size);
+        }
+        else
+        {
+            // Centered on transparent padding, which is all zeros in premultiplied ARGB32
+            std::vector<uint8_t> fitted(static_cast<size_t>(fit_width) * fit_height * 4);
+            scale_argb32(source, width, height, fitted.data(), fit_width, fit_height);
+
+            scaled = static_cast<uint8_t *>(g_malloc0(scaled_size));
+            int left = (size - fit_width) / 2;
+            int top = (size - fit_height) / 2;
+            for (int y = 0; y < fit_height; y++)
+            {
+                memcpy(scaled + (static_cast<size_t>(top + y) * size + left) * 4,
+                       fitted.data() + static_cast<size_t>(y) * fit_width * 4,
+                       static_cast<size_t>(fit_width) * 4);
+            }
+        }
+
+        chain.push_back({size, size, GBytesPtr(g_bytes_new_take(scaled, scaled_size))});
+    }
+
+    return chain;
+}
+
+GVariant *pixmaps_to_variant(const std::vector<Pixmap> &pixmaps)
+{
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(iiay)"));
+
+    for (const auto &pixmap : pixmaps)
+    {
+        g_variant_builder_add(&builder, "(ii@ay)",
+            pixmap.width,
+            pixmap.height,
+            g_variant_new_from_bytes(G_VARIANT_TYPE_BYTESTRING, pixmap.argb32.get(), TRUE));
+    }
+
+    return g_variant_builder_end(&builder);
+}
+
+namespace
+{
+    constexpr int GLYPH_WIDTH = 3;
+    constexpr int GLYPH_HEIGHT = 5;
+
+    // One row per entry, most significant of the low 3 bits is the leftmost pixel. Index 10 is '+'.
+    constexpr uint8_t GLYPH_ATLAS[11][GLYPH_HEIGHT] = {
+        {0b111, 0b101, 0b101, 0b101, 0b111},
+        {0b010, 0b110, 0b010, 0b010, 0b111},
+        {0b111, 0b001, 0b111, 0b100, 0b111},
+        {0b111, 0b001, 0b111, 0b001, 0b111},
+        {0b101, 0b101, 0b111, 0b001, 0b001},
+        {0b111, 0b100, 0b111, 0b001, 0b111},
+        {0b111, 0b100, 0b111, 0b101, 0b111},
+        {0b111, 0b001, 0b001, 0b001, 0b001},
+        {0b111, 0b101, 0b111, 0b101, 0b111},
+        {0b111, 0b101, 0b111, 0b001, 0b111},
+        {0b000, 0b010, 0b111, 0b010, 0b000},
+    };
+
+    constexpr uint8_t BADGE_RED = 0xED, BADGE_GREEN = 0x42, BADGE_BLUE = 0x45;
+
+    // Source-over of a straight color with the given coverage onto one premultiplied ARGB pixel
+    void blend_pixel(uint8_t *px, uint8_t r, uint8_t g, uint8_t b, float coverage)
+    {
+        uint32_t alpha = static_cast<uint32_t>(coverage * 255.0f + 0.5f);
+        uint32_t inverse = 255 - alpha;
+
+        px[0] = static_cast<uint8_t>(alpha + premultiply(px[0], inverse));
+        px[1] = static_cast<uint8_t>(premultiply(r, alpha) + premultiply(px[1], inverse));
+        px[2] = static_cast<uint8_t>(premultiply(g, alpha) + premultiply(px[2], inverse));
+        px[3] = static_cast<uint8_t>(premultiply(b, alpha) + premultiply(px[3], inverse));
+    }
+}
+
+void draw_count_badge(uint8_t *argb32, int width, int height, int count)
+{
+    int glyphs[3];
+    int glyph_count = 0;
+    if (count > 99)
+    {
+        glyphs[glyph_count++] = 9;
+        glyphs[glyph_count++] = 9;
+        glyphs[glyph_count++] = 10;
+    }
+    else
+    {
+        if (count >= 10)
+            glyphs[glyph_count++] = count / 10;
+        glyphs[glyph_count++] = count % 10;
+    }
+
+    int diameter = std::max(9, (std::min(width, height) * 3 + 2) / 5);
+    int scale = std::max(1, diameter * 11 / 100);
+    int padding = std::max(2, diameter / 4);
+    int text_width = glyph_count * GLYPH_WIDTH * scale + (glyph_count - 1) * scale;
+    int text_height = GLYPH_HEIGHT * scale;
+    int badge_width = std::min(width, std::max(diameter, text_width + padding * 2));
+
+    // Pill anchored to the bottom-right corner: a capsule around the segment between its two cap centers
+    float radius = diameter / 2.0f;
+    float left = static_cast<float>(width - badge_width);
+    float top = static_cast<float>(height - diameter);
+    float center_y = top + radius;
+    float cap_left = left + radius;
+    float cap_right = width - radius;
+
+    for (int y = std::max(0, height - diameter); y < height; y++)
+    {
+        for (int x = std::max(0, width - badge_width); x < width; x++)
+        {
+            float px = x + 0.5f, py = y + 0.5f;
+            float dx = px < cap_left ? px - cap_left : (px > cap_right ? px - cap_right : 0.0f);
+            float dy = py - center_y;
+            float coverage = std::clamp(radius - std::sqrt(dx * dx + dy * dy) + 0.5f, 0.0f, 1.0f);
+
+            if (coverage > 0.0f)
+                blend_pixel(argb32 + (static_cast<size_t>(y) * width + x) * 4, BADGE_RED, BADGE_GREEN, BADGE_BLUE, coverage);
+        }
+    }
+
+    int text_x = width - badge_width + (badge_width - text_width) / 2;
+    int text_y = height - diameter + (diameter - text_height + 1) / 2;
+
+    for (int g = 0; g < glyph_count; g++)
+    {
+        const uint8_t *glyph = GLYPH_ATLAS[glyphs[g]];
+        int glyph_x = text_x + g * (GLYPH_WIDTH + 1) * scale;
+
+        for (int row = 0; row < GLYPH_HEIGHT * scale; row++)
+        {
+            int y = text_y + row;
+            if (y < 0 || y >= height)
+                continue;
+
+            for (int col = 0; col < GLYPH_WIDTH * scale; col++)
+            {
+                int x = glyph_x + col;
+                if (x < 0 || x >= width || !(glyph[row / scale] & (1 << (GLYPH_WIDTH - 1 - col / scale))))
+                    continue;
+
+                uint8_t *px = argb32 + (static_cast<size_t>(y) * width + x) * 4;
+                px[0] = px[1] = px[2] = px[3] = 255;
+            }
+        }
+    }
+}
+
+static uint64_t hash_combine(uint64_t hash, uint64_t value)
+{
+    hash ^= value;
+    hash *= 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 29);
+}
+
+static uint64_t hash_data(uint64_t hash, const uint8_t *data, size_t size)
+{
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = hash_combine(hash, word);
+    }
+
+    uint64_t tail = 0;
+    if (size > i)
+        memcpy(&tail, data + i, size - i);
+    return hash_combine(hash, tail ^ (static_cast<uint64_t>(size) << 56));
+}
+
+uint64_t hash_pixmaps(GVariant *pixmaps)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+
+    // Hash entry by entry so the GBytes-backed children are read in place instead of flattening the whole array
+    gsize count = g_variant_n_children(pixmaps);
+    for (gsize i = 0; i < count; i++)
+    {
+        GVariantPtr entry(g_variant_get_child_value(pixmaps, i));
+        GVariantPtr data(g_variant_get_child_value(entry.get(), 2));
+
+        gint32 width, height;
+        g_variant_get_child(entry.get(), 0, "i", &width);
+        g_variant_get_child(entry.get(), 1, "i", &height);
+
+        hash = hash_combine(hash, (static_cast<uint64_t>(static_cast<uint32_t>(width)) << 32) | static_cast<uint32_t>(height));
+        hash = hash_data(hash, static_cast<const uint8_t *>(g_variant_get_data(data.get())), g_variant_get_size(data.get()));
+    }
+
+    return hash;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "glib_ptr.h"
+
+// Sizes published in IconPixmap so hosts can pick an exact match instead of rescaling on every repaint
+constexpr int ICON_PIXMAP_SIZES[] = {16, 22, 24, 32, 48, 64};
+
+struct Pixmap
+{
+    int32_t width;
+    int32_t height;
+    GBytesPtr argb32;
+};
+
+// Converts a straight-alpha BGRA bitmap (the layout returned by Electron's NativeImage.toBitmap())
+// into premultiplied ARGB32 in network byte order, which is what StatusNotifierItem hosts expect
+// in IconPixmap. dst must hold width * height * 4 bytes and is written tightly packed.
+void bitmap_to_argb32_premultiplied(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *dst);
+
+// Name of the conversion kernel picked for this CPU ("avx2", "sse2", "neon" or "scalar").
+const char *pixmap_kernel_name();
+
+// Area-averaging (box filter) resample of a premultiplied ARGB32 image. Works for both down- and upscaling.
+void scale_argb32(const uint8_t *src, int src_width, int src_height, uint8_t *dst, int dst_width, int dst_height);
+
+// Converts one bitmap and resamples it to every size in ICON_PIXMAP_SIZES, smallest first. A non-square
+// bitmap is fitted inside each square with its aspect ratio kept and transparent padding around it.
+std::vector<Pixmap> build_icon_pixmap_chain(const uint8_t *bitmap, size_t stride, int width, int height);
+
+// Packs pixmaps into a floating `a(iiay)` variant without copying their pixel data.
+GVariant *pixmaps_to_variant(const std::vector<Pixmap> &pixmaps);
+
+// Draws an unread-count pill ("1".."99", then "99+") into the bottom-right corner of a premultiplied
+// ARGB32 image, using the built-in 3x5 digit atlas scaled to the icon size.
+void draw_count_badge(uint8_t *argb32, int width, int height, int count);
+
+// Content hash of an `a(iiay)` variant, used to avoid re-announcing an icon hosts already show.
+uint64_t hash_pixmaps(GVariant *pixmaps);
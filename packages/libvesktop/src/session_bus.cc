@@ -0,0 +1,217 @@
+#include "session_bus.h"
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <vector>
+
+// A private connection rather than g_bus_get_sync()'s singleton: the singleton exits the whole
+// process when the bus closes, and it can't be replaced once it's gone.
+static std::mutex g_session_bus_mutex;
+static GObjectPtr<GDBusConnection> g_session_bus;
+// Thread-default context g_session_bus was opened on, where its `closed` signal is delivered; null
+// when it was opened on a thread without one. Only compared, never dereferenced.
+static GMainContext *g_session_bus_context = nullptr;
+static gint64 g_last_connect_failure = 0;
+
+// Don't hammer a dead bus from the badge hot path; retry at most this often (microseconds)
+static constexpr gint64 RECONNECT_INTERVAL = G_USEC_PER_SEC;
+
+// Backoff between reconnect attempts made for listeners (milliseconds)
+static constexpr guint MIN_RETRY_INTERVAL_MS = 1000;
+static constexpr guint MAX_RETRY_INTERVAL_MS = 60000;
+
+// Only touched on the D-Bus thread
+static std::map<guint, std::function<void()>> g_listeners;
+static guint g_next_listener_id = 1;
+static GSource *g_notify_source = nullptr;
+static GSource *g_retry_source = nullptr;
+static guint g_retry_interval_ms = 0;
+
+static void retry_session_bus();
+
+static void destroy_source(GSource *&source)
+{
+    if (!source)
+        return;
+
+    g_source_destroy(source);
+    g_source_unref(source);
+    source = nullptr;
+}
+
+static gboolean on_notify_listeners(gpointer user_data)
+{
+    g_source_unref(g_notify_source);
+    g_notify_source = nullptr;
+
+    destroy_source(g_retry_source);
+    g_retry_interval_ms = 0;
+
+    // Listeners may remove themselves or each other
+    std::vector<guint> ids;
+    for (const auto &entry : g_listeners)
+        ids.push_back(entry.first);
+
+    for (guint id : ids)
+    {
+        auto it = g_listeners.find(id);
+        if (it == g_listeners.end())
+            continue;
+
+        std::function<void()> listener = it->second;
+        listener();
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static void on_session_bus_closed(GDBusConnection *connection, gboolean remote_peer_vanished, GError *error, gpointer user_data)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_session_bus_mutex);
+
+        if (g_session_bus.get() != connection)
+            return;
+
+        std::cerr << "[libvesktop::session_bus] Session bus connection closed: "
+                  << (error ? error->message : "closed locally") << std::endl;
+        g_session_bus.reset();
+    }
+
+    retry_session_bus();
+}
+
+static gboolean on_retry_timeout(gpointer user_data)
+{
+    g_source_unref(g_retry_source);
+    g_retry_source = nullptr;
+
+    retry_session_bus();
+    return G_SOURCE_REMOVE;
+}
+
+// Reconnects on behalf of the listeners; get_session_bus() notifies them once a new connection opens
+static void retry_session_bus()
+{
+    if (g_listeners.empty() || g_retry_source)
+        return;
+
+    GError *error = nullptr;
+    GObjectPtr<GDBusConnection> bus = get_session_bus(&error);
+    GErrorPtr error_ptr(error);
+    if (bus)
+        return;
+
+    g_retry_interval_ms = std::clamp(g_retry_interval_ms * 2, MIN_RETRY_INTERVAL_MS, MAX_RETRY_INTERVAL_MS);
+    std::cerr << "[libvesktop::session_bus] Failed to reconnect to session bus: "
+              << (error_ptr ? error_ptr->message : "unknown error") << ", retrying in "
+              << g_retry_interval_ms / 1000 << "s" << std::endl;
+
+    g_retry_source = g_timeout_source_new(g_retry_interval_ms);
+    g_source_set_callback(g_retry_source, on_retry_timeout, nullptr, nullptr);
+    g_source_attach(g_retry_source, g_main_context_get_thread_default());
+}
+
+static GDBusConnection *connect_session_bus(GError **error)
+{
+    gchar *address = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, nullptr, error);
+    if (!address)
+        return nullptr;
+
+    GDBusConnection *connection = g_dbus_connection_new_for_address_sync(
+        address,
+        static_cast<GDBusConnectionFlags>(
+            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+        nullptr,
+        nullptr,
+        error);
+
+    g_free(address);
+
+    if (connection)
+        g_dbus_connection_set_exit_on_close(connection, FALSE);
+
+    return connection;
+}
+
+GObjectPtr<GDBusConnection> get_session_bus(GError **error)
+{
+    std::lock_guard<std::mutex> lock(g_session_bus_mutex);
+
+    // Connections opened without a context never see `closed`, so check those here
+    if (g_session_bus && g_dbus_connection_is_closed(g_session_bus.get()))
+    {
+        std::cerr << "[libvesktop::get_session_bus] Session bus connection closed, reconnecting" << std::endl;
+        g_session_bus.reset();
+    }
+
+    GMainContext *context = g_main_context_get_thread_default();
+
+    // Opened on the JS thread or a worker before the D-Bus thread needed it; reopen it here so its
+    // `closed` signal has somewhere to go. Holders of the old connection keep it until they're done.
+    if (g_session_bus && context && g_session_bus_context != context)
+        g_session_bus.reset();
+
+    if (!g_session_bus)
+    {
+        gint64 now = g_get_monotonic_time();
+        if (g_last_connect_failure != 0 && now - g_last_connect_failure < RECONNECT_INTERVAL)
+        {
+            g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED, "Session bus unavailable");
+            return nullptr;
+        }
+
+        g_session_bus.reset(connect_session_bus(error));
+        g_last_connect_failure = g_session_bus ? 0 : now;
+
+        if (!g_session_bus)
+            return nullptr;
+
+        g_session_bus_context = context;
+
+        if (context)
+        {
+            g_signal_connect(g_session_bus.get(), "closed", G_CALLBACK(on_session_bus_closed), nullptr);
+
+            // Deferred so listeners never run inside their own get_session_bus() call
+            if (!g_notify_source)
+            {
+                g_notify_source = g_idle_source_new();
+                g_source_set_callback(g_notify_source, on_notify_listeners, nullptr, nullptr);
+                g_source_attach(g_notify_source, context);
+            }
+        }
+    }
+
+    return GObjectPtr<GDBusConnection>(static_cast<GDBusConnection *>(g_object_ref(g_session_bus.get())));
+}
+
+bool session_bus_connected()
+{
+    std::lock_guard<std::mutex> lock(g_session_bus_mutex);
+    return g_session_bus && !g_dbus_connection_is_closed(g_session_bus.get());
+}
+
+guint add_session_bus_listener(std::function<void()> listener)
+{
+    guint id = g_next_listener_id++;
+    g_listeners.emplace(id, std::move(listener));
+
+    // Connects now if there is no bus yet (or only one this thread can't watch), and keeps trying
+    retry_session_bus();
+
+    return id;
+}
+
+void remove_session_bus_listener(guint id)
+{
+    g_listeners.erase(id);
+
+    if (g_listeners.empty())
+    {
+        destroy_source(g_retry_source);
+        destroy_source(g_notify_source);
+        g_retry_interval_ms = 0;
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <gio/gio.h>
+#include <functional>
+#include "glib_ptr.h"
+
+// Returns a new reference to the addon's shared session bus connection. The connection is opened on
+// first use and reopened transparently after the bus goes away; returns nullptr and sets error if the
+// bus cannot be reached. Safe to call from any thread.
+//
+// A connection opened on a thread running its own main context (the addon's D-Bus thread) gets its
+// `closed` signal there, which drops it and notifies the listeners below. Called from such a thread,
+// a connection opened elsewhere is replaced, since nothing would see it close.
+GObjectPtr<GDBusConnection> get_session_bus(GError **error);
+
+// Whether the shared connection exists and is still open. Never connects.
+bool session_bus_connected();
+
+// Registers a callback for every new connection that replaces a closed or missing one. While any
+// listener is registered, a lost bus is retried with backoff rather than on the next
+// get_session_bus(). Both functions, and the callbacks, run on the D-Bus thread only.
+guint add_session_bus_listener(std::function<void()> listener);
+void remove_session_bus_listener(guint id);
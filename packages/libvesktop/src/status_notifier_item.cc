@@ -1,30 +1,10 @@
 #include "status_notifier_item.h"
+#include "pixmap.h"
+#include <algorithm>
 #include <iostream>
 #include <cstring>
 #include <unistd.h>
 
-struct GVariantDeleter
-{
-    void operator()(GVariant *variant) const
-    {
-        if (variant)
-            g_variant_unref(variant);
-    }
-};
-
-using GVariantPtr = std::unique_ptr<GVariant, GVariantDeleter>;
-
-struct GErrorDeleter
-{
-    void operator()(GError *error) const
-    {
-        if (error)
-            g_error_free(error);
-    }
-};
-
-using GErrorPtr = std::unique_ptr<GError, GErrorDeleter>;
-
 const char *StatusNotifierItem::introspection_xml = R"XML(
 <node>
   <interface name="org.kde.StatusNotifierItem">
@@ -35,6 +15,7 @@ const char *StatusNotifierItem::introspection_xml = R"XML(
     <property name="IconName" type="s" access="read"/>
     <property name="IconPixmap" type="a(iiay)" access="read"/>
     <property name="AttentionIconName" type="s" access="read"/>
+    <property name="AttentionIconPixmap" type="a(iiay)" access="read"/>
     <property name="ToolTip" type="(sa(iiay)ss)" access="read"/>
     <property name="ItemIsMenu" type="b" access="read"/>
     <property name="Menu" type="o" access="read"/>
@@ -55,6 +36,7 @@ const char *StatusNotifierItem::introspection_xml = R"XML(
       <arg type="s" name="orientation" direction="in"/>
     </method>
     <signal name="NewIcon"/>
+    <signal name="NewAttentionIcon"/>
     <signal name="NewTitle"/>
     <signal name="NewStatus">
       <arg type="s" name="status"/>
@@ -136,28 +118,46 @@ void StatusNotifierItem::handle_method_call(
     (void)sender;
     (void)object_path;
     (void)interface_name;
-    (void)parameters;
 
     auto *self = static_cast<StatusNotifierItem *>(user_data);
 
     if (g_strcmp0(method_name, "Activate") == 0)
     {
+        gint32 x, y;
+        g_variant_get(parameters, "(ii)", &x, &y);
+
         if (self->activate_callback)
         {
-            self->activate_callback();
+            self->activate_callback(x, y);
         }
         g_dbus_method_invocation_return_value(invocation, nullptr);
     }
     else if (g_strcmp0(method_name, "SecondaryActivate") == 0)
     {
+        gint32 x, y;
+        g_variant_get(parameters, "(ii)", &x, &y);
+
+        if (self->secondary_activate_callback)
+            self->secondary_activate_callback(x, y);
         g_dbus_method_invocation_return_value(invocation, nullptr);
     }
     else if (g_strcmp0(method_name, "ContextMenu") == 0)
     {
+        gint32 x, y;
+        g_variant_get(parameters, "(ii)", &x, &y);
+
+        if (self->context_menu_callback)
+            self->context_menu_callback(x, y);
         g_dbus_method_invocation_return_value(invocation, nullptr);
     }
     else if (g_strcmp0(method_name, "Scroll") == 0)
     {
+        gint32 delta;
+        const gchar *orientation;
+        g_variant_get(parameters, "(i&s)", &delta, &orientation);
+
+        // The spec says "horizontal" or "vertical", some hosts capitalize it
+        self->queue_scroll(delta, g_ascii_strcasecmp(orientation, "horizontal") == 0);
         g_dbus_method_invocation_return_value(invocation, nullptr);
     }
 }
@@ -195,29 +195,9 @@ GVariant *StatusNotifierItem::handle_get_property(
     }
     else if (g_strcmp0(property_name, "IconPixmap") == 0)
     {
-        if (!self->current_icon_pixmap.empty() && self->current_icon_pixmap.size() >= 8)
+        if (self->icon_pixmap)
         {
-            GVariantBuilder builder;
-            g_variant_builder_init(&builder, G_VARIANT_TYPE("a(iiay)"));
-
-            int width, height;
-            memcpy(&width, self->current_icon_pixmap.data(), 4);
-            memcpy(&height, self->current_icon_pixmap.data() + 4, 4);
-
-            GVariantBuilder data_builder;
-            g_variant_builder_init(&data_builder, G_VARIANT_TYPE("ay"));
-
-            for (size_t i = 8; i < self->current_icon_pixmap.size(); i++)
-            {
-                g_variant_builder_add(&data_builder, "y", self->current_icon_pixmap[i]);
-            }
-
-            g_variant_builder_add(&builder, "(ii@ay)",
-                width,
-                height,
-                g_variant_builder_end(&data_builder));
-
-            return g_variant_builder_end(&builder);
+            return g_variant_ref(self->icon_pixmap.get());
         }
         return g_variant_new_array(G_VARIANT_TYPE("(iiay)"), nullptr, 0);
     }
@@ -225,6 +205,14 @@ GVariant *StatusNotifierItem::handle_get_property(
     {
         return g_variant_new_string("");
     }
+    else if (g_strcmp0(property_name, "AttentionIconPixmap") == 0)
+    {
+        if (self->attention_icon_pixmap)
+        {
+            return g_variant_ref(self->attention_icon_pixmap.get());
+        }
+        return g_variant_new_array(G_VARIANT_TYPE("(iiay)"), nullptr, 0);
+    }
     else if (g_strcmp0(property_name, "ToolTip") == 0)
     {
         GVariantBuilder builder;
@@ -269,59 +257,39 @@ void StatusNotifierItem::handle_menu_method_call(
     {
         gint32 parent_id;
         gint32 recursion_depth;
-        GVariantIter *property_names_iter;
-        g_variant_get(parameters, "(iias)", &parent_id, &recursion_depth, &property_names_iter);
-        g_variant_iter_free(property_names_iter);
-
-        GVariantBuilder layout_builder;
-        g_variant_builder_init(&layout_builder, G_VARIANT_TYPE("(ia{sv}av)"));
-
-        g_variant_builder_add(&layout_builder, "i", 0);
+        GVariant *property_names;
+        g_variant_get(parameters, "(ii@as)", &parent_id, &recursion_depth, &property_names);
+        uint32_t mask = menu_property_mask(property_names);
+        g_variant_unref(property_names);
 
-        GVariantBuilder props_builder;
-        g_variant_builder_init(&props_builder, G_VARIANT_TYPE("a{sv}"));
-        g_variant_builder_add(&layout_builder, "a{sv}", &props_builder);
-
-        GVariantBuilder children_builder;
-        g_variant_builder_init(&children_builder, G_VARIANT_TYPE("av"));
-
-        for (const auto &item : self->menu_items)
+        GVariant *layout;
+        if (parent_id == MenuModel::ROOT_ID && recursion_depth < 0 && mask == MENU_PROPERTIES_ALL)
         {
-
-            GVariantBuilder item_builder;
-            g_variant_builder_init(&item_builder, G_VARIANT_TYPE("(ia{sv}av)"));
-
-            g_variant_builder_add(&item_builder, "i", item.id);
-
-            GVariantBuilder item_props_builder;
-            g_variant_builder_init(&item_props_builder, G_VARIANT_TYPE("a{sv}"));
-
-            if (item.is_separator)
-            {
-                g_variant_builder_add(&item_props_builder, "{sv}", "type", g_variant_new_string("separator"));
-                g_variant_builder_add(&item_props_builder, "{sv}", "visible", g_variant_new_boolean(item.visible));
-            }
-            else
+            // Layout changes bump menu_revision and property changes drop the cache, so a matching cache
+            // is current and replying is a ref
+            if (!self->layout || self->layout_revision != self->menu_revision)
             {
-                g_variant_builder_add(&item_props_builder, "{sv}", "label", g_variant_new_string(item.label.c_str()));
-                g_variant_builder_add(&item_props_builder, "{sv}", "enabled", g_variant_new_boolean(item.enabled));
-                g_variant_builder_add(&item_props_builder, "{sv}", "visible", g_variant_new_boolean(item.visible));
-                g_variant_builder_add(&item_props_builder, "{sv}", "toggle-type", g_variant_new_string(""));
+                self->layout.reset(g_variant_ref_sink(self->menu.build_layout(MenuModel::ROOT_ID, -1)));
+                self->layout_revision = self->menu_revision;
             }
-
-            g_variant_builder_add(&item_builder, "a{sv}", &item_props_builder);
-
-            GVariantBuilder empty_children;
-            g_variant_builder_init(&empty_children, G_VARIANT_TYPE("av"));
-            g_variant_builder_add(&item_builder, "av", &empty_children);
-
-            g_variant_builder_add(&children_builder, "v", g_variant_builder_end(&item_builder));
+            layout = self->layout.get();
+        }
+        else
+        {
+            // Submenus are fetched one level at a time as they open, and filtered requests only carry
+            // part of each item; both are small enough to build on demand
+            layout = self->menu.build_layout(parent_id, recursion_depth, mask);
         }
 
-        g_variant_builder_add(&layout_builder, "av", &children_builder);
+        if (!layout)
+        {
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                "Unknown menu item %d", parent_id);
+            return;
+        }
 
         g_dbus_method_invocation_return_value(invocation,
-            g_variant_new("(u@(ia{sv}av))", self->menu_revision, g_variant_builder_end(&layout_builder)));
+            g_variant_new("(u@(ia{sv}av))", self->menu_revision, layout));
     }
     else if (g_strcmp0(method_name, "Event") == 0)
     {
@@ -329,15 +297,10 @@ void StatusNotifierItem::handle_menu_method_call(
         const gchar *event_id;
         GVariant *data;
         guint32 timestamp;
-        g_variant_get(parameters, "(isvu)", &id, &event_id, &data, &timestamp);
+        g_variant_get(parameters, "(i&svu)", &id, &event_id, &data, &timestamp);
 
         if (g_strcmp0(event_id, "clicked") == 0)
-        {
-            if (self->menu_click_callback)
-            {
-                self->menu_click_callback(id);
-            }
-        }
+            self->handle_menu_clicks({{id, timestamp}});
 
         g_variant_unref(data);
         g_dbus_method_invocation_return_value(invocation, nullptr);
@@ -354,47 +317,64 @@ void StatusNotifierItem::handle_menu_method_call(
         const gchar *event_id;
         GVariant *data;
         guint32 timestamp;
+        std::vector<std::pair<int32_t, uint32_t>> clicks;
 
-        while (g_variant_iter_next(events_iter, "(isvu)", &id, &event_id, &data, &timestamp))
+        while (g_variant_iter_next(events_iter, "(i&svu)", &id, &event_id, &data, &timestamp))
         {
             if (g_strcmp0(event_id, "clicked") == 0)
-            {
-                if (self->menu_click_callback)
-                {
-                    self->menu_click_callback(id);
-                }
-            }
+                clicks.emplace_back(id, timestamp);
             g_variant_unref(data);
         }
 
         g_variant_iter_free(events_iter);
+        self->handle_menu_clicks(clicks);
         g_dbus_method_invocation_return_value(invocation,
             g_variant_new("(@ai)", g_variant_builder_end(&errors_builder)));
     }
     else if (g_strcmp0(method_name, "AboutToShow") == 0)
     {
-        g_dbus_method_invocation_return_value(invocation, g_variant_new("(b)", TRUE));
+        gint32 id;
+        g_variant_get(parameters, "(i)", &id);
+
+        if (!self->menu.find(id))
+        {
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                "Unknown menu item %d", id);
+            return;
+        }
+
+        self->request_about_to_show({invocation}, id);
     }
     else if (g_strcmp0(method_name, "AboutToShowGroup") == 0)
     {
         GVariantIter *ids_iter;
         g_variant_get(parameters, "(ai)", &ids_iter);
-        g_variant_iter_free(ids_iter);
 
-        GVariantBuilder updates_builder;
-        g_variant_builder_init(&updates_builder, G_VARIANT_TYPE("ai"));
+        PendingAboutToShow request{invocation};
+        request.group = true;
 
-        GVariantBuilder errors_builder;
-        g_variant_builder_init(&errors_builder, G_VARIANT_TYPE("ai"));
+        gint32 id;
+        while (g_variant_iter_next(ids_iter, "i", &id))
+        {
+            if (self->menu.find(id))
+                request.ids.push_back(id);
+            else
+                request.id_errors.push_back(id);
+        }
 
-        g_dbus_method_invocation_return_value(invocation,
-            g_variant_new("(@ai@ai)", g_variant_builder_end(&updates_builder), g_variant_builder_end(&errors_builder)));
+        g_variant_iter_free(ids_iter);
+
+        // The provider fills in the whole menu whichever item is opening, so the first id stands for all
+        int32_t first_id = request.ids.empty() ? MenuModel::ROOT_ID : request.ids.front();
+        self->request_about_to_show(std::move(request), first_id);
     }
     else if (g_strcmp0(method_name, "GetGroupProperties") == 0)
     {
         GVariantIter *ids_iter;
-        GVariantIter *property_names_iter;
-        g_variant_get(parameters, "(aias)", &ids_iter, &property_names_iter);
+        GVariant *property_names;
+        g_variant_get(parameters, "(ai@as)", &ids_iter, &property_names);
+        uint32_t mask = menu_property_mask(property_names);
+        g_variant_unref(property_names);
 
         std::vector<int32_t> requested_ids;
         gint32 id;
@@ -404,84 +384,53 @@ void StatusNotifierItem::handle_menu_method_call(
         }
 
         g_variant_iter_free(ids_iter);
-        g_variant_iter_free(property_names_iter);
+
+        // An empty list means every item
+        if (requested_ids.empty())
+            requested_ids = self->menu.ids();
 
         GVariantBuilder props_builder;
         g_variant_builder_init(&props_builder, G_VARIANT_TYPE("a(ia{sv})"));
 
-        bool root_requested = false;
-        for (auto rid : requested_ids)
+        for (int32_t requested_id : requested_ids)
         {
-            if (rid == 0)
-            {
-                root_requested = true;
-                break;
-            }
+            const MenuNode *node = self->menu.find(requested_id);
+            if (!node)
+                continue;
+
+            g_variant_builder_add(&props_builder, "(i@a{sv})", requested_id, self->menu.build_properties(*node, mask));
         }
 
-        if (root_requested || requested_ids.empty())
-        {
-            GVariantBuilder root_builder;
-            g_variant_builder_init(&root_builder, G_VARIANT_TYPE("(ia{sv})"));
-            g_variant_builder_add(&root_builder, "i", 0);
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(@a(ia{sv}))", g_variant_builder_end(&props_builder)));
+    }
+    else if (g_strcmp0(method_name, "GetProperty") == 0)
+    {
+        gint32 id;
+        const gchar *name;
+        g_variant_get(parameters, "(i&s)", &id, &name);
 
-            GVariantBuilder root_props;
-            g_variant_builder_init(&root_props, G_VARIANT_TYPE("a{sv}"));
-            g_variant_builder_add(&root_props, "{sv}", "children-display", g_variant_new_string("submenu"));
+        const MenuNode *node = self->menu.find(id);
+        uint32_t property = menu_property_from_name(name);
 
-            g_variant_builder_add(&root_builder, "@a{sv}", g_variant_builder_end(&root_props));
-            g_variant_builder_add(&props_builder, "@(ia{sv})", g_variant_builder_end(&root_builder));
+        if (!node)
+        {
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                "Unknown menu item %d", id);
+            return;
         }
 
-        for (const auto &item : self->menu_items)
+        if (!property)
         {
-            if (!requested_ids.empty())
-            {
-                bool found = false;
-                for (auto req_id : requested_ids)
-                {
-                    if (req_id == item.id)
-                    {
-                        found = true;
-                        break;
-                    }
-                }
-                if (!found)
-                {
-                    continue;
-                }
-            }
-
-            GVariantBuilder item_builder;
-            g_variant_builder_init(&item_builder, G_VARIANT_TYPE("(ia{sv})"));
-            g_variant_builder_add(&item_builder, "i", item.id);
-
-            GVariantBuilder item_props;
-            g_variant_builder_init(&item_props, G_VARIANT_TYPE("a{sv}"));
-
-            if (item.is_separator)
-            {
-                g_variant_builder_add(&item_props, "{sv}", "type", g_variant_new_string("separator"));
-                g_variant_builder_add(&item_props, "{sv}", "visible", g_variant_new_boolean(item.visible));
-            }
-            else
-            {
-                g_variant_builder_add(&item_props, "{sv}", "label", g_variant_new_string(item.label.c_str()));
-                g_variant_builder_add(&item_props, "{sv}", "enabled", g_variant_new_boolean(item.enabled));
-                g_variant_builder_add(&item_props, "{sv}", "visible", g_variant_new_boolean(item.visible));
-                g_variant_builder_add(&item_props, "{sv}", "toggle-type", g_variant_new_string(""));
-            }
-
-            g_variant_builder_add(&item_builder, "@a{sv}", g_variant_builder_end(&item_props));
-            g_variant_builder_add(&props_builder, "@(ia{sv})", g_variant_builder_end(&item_builder));
-
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                "Unknown property %s", name);
+            return;
         }
 
-        g_dbus_method_invocation_return_value(invocation, g_variant_new("(@a(ia{sv}))", g_variant_builder_end(&props_builder)));
-    }
-    else if (g_strcmp0(method_name, "GetProperty") == 0)
-    {
-        g_dbus_method_invocation_return_value(invocation, g_variant_new("(v)", g_variant_new_string("")));
+        GVariant *value = self->menu.property_value(*node, static_cast<MenuProperty>(property));
+        if (!value)
+            value = menu_property_default(static_cast<MenuProperty>(property));
+
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(v)", value));
     }
 }
 
@@ -524,9 +473,10 @@ GVariant *StatusNotifierItem::handle_menu_get_property(
 }
 
 StatusNotifierItem::StatusNotifierItem()
+    : context(g_main_context_ref_thread_default())
 {
     GError *error = nullptr;
-    bus.reset(g_bus_get_sync(G_BUS_TYPE_SESSION, nullptr, &error));
+    bus = get_session_bus(&error);
 
     if (!bus)
     {
@@ -539,25 +489,156 @@ StatusNotifierItem::StatusNotifierItem()
 }
 
 StatusNotifierItem::~StatusNotifierItem()
+{
+    if (animation_source)
+    {
+        g_source_destroy(animation_source);
+        g_source_unref(animation_source);
+    }
+
+    if (flush_source)
+    {
+        g_source_destroy(flush_source);
+        g_source_unref(flush_source);
+    }
+
+    if (scroll_source)
+    {
+        g_source_destroy(scroll_source);
+        g_source_unref(scroll_source);
+    }
+
+    if (reexport_source)
+    {
+        g_source_destroy(reexport_source);
+        g_source_unref(reexport_source);
+    }
+
+    if (bus_listener_id)
+        remove_session_bus_listener(bus_listener_id);
+
+    // Hosts still waiting get the menu as it is
+    answer_about_to_show(false);
+
+    unexport();
+
+    g_main_context_unref(context);
+}
+
+void StatusNotifierItem::unexport()
 {
     if (bus)
     {
         if (menu_registration_id != 0)
         {
             g_dbus_connection_unregister_object(bus.get(), menu_registration_id);
+            menu_registration_id = 0;
         }
         if (registration_id != 0)
         {
             g_dbus_connection_unregister_object(bus.get(), registration_id);
+            registration_id = 0;
         }
     }
+
+    // The connection is shared and outlives us, so the name and watch have to be released explicitly
+    if (owner_id != 0)
+    {
+        g_bus_unown_name(owner_id);
+        owner_id = 0;
+    }
+
+    if (watcher_id != 0)
+    {
+        g_bus_unwatch_name(watcher_id);
+        watcher_id = 0;
+    }
+
+    if (registration_cancellable)
+    {
+        g_cancellable_cancel(registration_cancellable.get());
+        registration_cancellable.reset();
+    }
+
+    watcher_present = false;
+    registered_with_watcher = false;
 }
 
 bool StatusNotifierItem::initialize()
 {
-    if (!bus)
+    if (!bus || !export_on_bus())
         return false;
 
+    // The shared connection is replaced when the bus goes away; follow it there
+    bus_listener_id = add_session_bus_listener([this] { reexport(); });
+
+    return true;
+}
+
+gboolean StatusNotifierItem::on_reexport_retry(gpointer user_data)
+{
+    auto *self = static_cast<StatusNotifierItem *>(user_data);
+
+    g_source_unref(self->reexport_source);
+    self->reexport_source = nullptr;
+
+    self->reexport();
+    return G_SOURCE_REMOVE;
+}
+
+void StatusNotifierItem::reexport()
+{
+    if (reexport_source)
+    {
+        g_source_destroy(reexport_source);
+        g_source_unref(reexport_source);
+        reexport_source = nullptr;
+    }
+
+    GError *error = nullptr;
+    GObjectPtr<GDBusConnection> next = get_session_bus(&error);
+    if (!next)
+    {
+        // The session bus listener runs again once a connection opens
+        GErrorPtr error_ptr(error);
+        return;
+    }
+
+    if (next.get() != bus.get())
+    {
+        // Everything tied to the old connection goes with it; invocations on it can't be answered anymore
+        answer_about_to_show(false);
+        unexport();
+        bus = std::move(next);
+    }
+    else if (exported)
+    {
+        return;
+    }
+    else
+    {
+        // An earlier attempt on this connection got partway
+        unexport();
+    }
+
+    exported = export_on_bus() && (!menu_set || register_menu());
+    if (!exported)
+    {
+        std::cerr << "[libvesktop::StatusNotifierItem] Failed to export on the new session bus connection, retrying"
+                  << std::endl;
+        unexport();
+
+        reexport_source = g_timeout_source_new_seconds(REEXPORT_RETRY_S);
+        g_source_set_callback(reexport_source, on_reexport_retry, this, nullptr);
+        g_source_attach(reexport_source, context);
+    }
+
+    // The watcher appearing on the new connection registers us again
+    update_animation_timer();
+}
+
+bool StatusNotifierItem::export_on_bus()
+{
     GError *error = nullptr;
 
     static GDBusInterfaceVTable vtable = {
@@ -594,7 +675,7 @@ bool StatusNotifierItem::initialize()
     GBusNameOwnerFlags flags = static_cast<GBusNameOwnerFlags>(
         G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT | G_BUS_NAME_OWNER_FLAGS_REPLACE);
 
-    guint owner_id = g_bus_own_name_on_connection(
+    owner_id = g_bus_own_name_on_connection(
         bus.get(),
         service_name.c_str(),
         flags,
@@ -608,17 +689,29 @@ bool StatusNotifierItem::initialize()
         return false;
     }
 
+    watcher_id = g_bus_watch_name_on_connection(
+        bus.get(),
+        WATCHER_SERVICE,
+        G_BUS_NAME_WATCHER_FLAGS_NONE,
+        on_watcher_appeared,
+        on_watcher_vanished,
+        this,
+        nullptr);
+
+    exported = true;
     return true;
 }
 
-bool StatusNotifierItem::register_with_watcher()
+void StatusNotifierItem::register_with_watcher()
 {
-    if (!bus || registered_with_watcher)
-        return true;
+    // Hosts only learn about us once there is an icon to show
+    if (!bus || registered_with_watcher || registration_cancellable || !watcher_present || !icon_pixmap)
+        return;
 
-    GError *error = nullptr;
+    registration_cancellable.reset(g_cancellable_new());
+    registering_icon_hash = current_icon_hash;
 
-    GVariantPtr reply(g_dbus_connection_call_sync(
+    g_dbus_connection_call(
         bus.get(),
         WATCHER_SERVICE,
         WATCHER_PATH,
@@ -627,111 +720,601 @@ bool StatusNotifierItem::register_with_watcher()
         g_variant_new("(s)", service_name.c_str()),
         nullptr,
         G_DBUS_CALL_FLAGS_NONE,
-        -1,
-        nullptr,
-        &error));
+        WATCHER_TIMEOUT_MS,
+        registration_cancellable.get(),
+        on_register_reply,
+        this);
+}
+
+void StatusNotifierItem::on_register_reply(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    GError *error = nullptr;
+    GVariantPtr reply(g_dbus_connection_call_finish(reinterpret_cast<GDBusConnection *>(source), result, &error));
+    GErrorPtr error_ptr(error);
+
+    // Cancelled calls may complete after the item is gone, so don't touch it
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+    auto *self = static_cast<StatusNotifierItem *>(user_data);
+    self->registration_cancellable.reset();
 
     if (!reply)
     {
-        GErrorPtr error_ptr(error);
-        return false;
+        std::cerr << "[libvesktop::StatusNotifierItem] Failed to register with watcher: "
+                  << (error ? error->message : "unknown error") << std::endl;
+        return;
     }
 
-    g_dbus_connection_emit_signal(
-        bus.get(),
-        nullptr,
-        object_path.c_str(),
-        SNI_INTERFACE,
-        "NewStatus",
-        g_variant_new("(s)", "Active"),
-        nullptr);
+    self->registered_with_watcher = true;
 
-    registered_with_watcher = true;
-    return true;
+    // Registering makes the host fetch every property, so only changes made since the call need announcing
+    self->announced_icon_hash = self->registering_icon_hash;
+    if (self->current_icon_hash != self->announced_icon_hash)
+        self->queue_update(PENDING_NEW_ICON);
+
+    self->queue_update(PENDING_NEW_STATUS);
+    self->update_animation_timer();
 }
 
-bool StatusNotifierItem::set_icon_pixmap(const std::vector<uint8_t> &pixmap_data)
+void StatusNotifierItem::on_watcher_appeared(GDBusConnection *connection, const gchar *name, const gchar *name_owner, gpointer user_data)
 {
-    if (!bus)
-        return false;
+    auto *self = static_cast<StatusNotifierItem *>(user_data);
+
+    // A new owner (e.g. a restarted plasmashell) knows nothing about us
+    self->watcher_present = true;
+    self->registered_with_watcher = false;
+    self->register_with_watcher();
+}
+
+void StatusNotifierItem::on_watcher_vanished(GDBusConnection *connection, const gchar *name, gpointer user_data)
+{
+    auto *self = static_cast<StatusNotifierItem *>(user_data);
 
-    current_icon_pixmap = pixmap_data;
+    self->watcher_present = false;
+    self->registered_with_watcher = false;
 
-    if (!registered_with_watcher)
+    if (self->registration_cancellable)
     {
-        if (!register_with_watcher())
-        {
-            return false;
-        }
+        g_cancellable_cancel(self->registration_cancellable.get());
+        self->registration_cancellable.reset();
     }
-    else
+
+    self->update_animation_timer();
+}
+
+bool StatusNotifierItem::set_icon_pixmap(GVariant *pixmap)
+{
+    if (!bus)
+        return false;
+
+    pixmap_icon.pixmap.reset(g_variant_ref_sink(pixmap));
+    pixmap_icon.hash = hash_pixmaps(pixmap_icon.pixmap.get());
+    current_icon_slot = -1;
+
+    if (animation_frames.empty())
     {
-        GError *error = nullptr;
-        gboolean result = g_dbus_connection_emit_signal(
-            bus.get(),
-            nullptr,
-            object_path.c_str(),
-            SNI_INTERFACE,
-            "NewIcon",
-            nullptr,
-            &error);
-
-        if (!result || error)
-        {
-            GErrorPtr error_ptr(error);
-            return false;
-        }
+        icon_pixmap.reset(g_variant_ref(pixmap_icon.pixmap.get()));
+        queue_icon_update(pixmap_icon.hash);
     }
 
     return true;
 }
 
-bool StatusNotifierItem::set_title(const std::string &title)
+void StatusNotifierItem::set_icon_slots(std::vector<IconSlot> slots)
+{
+    for (auto &slot : slots)
+        slot.hash = hash_pixmaps(slot.pixmap.get());
+
+    icon_slots = std::move(slots);
+    badge_cache.clear();
+    current_icon_slot = -1;
+    attention_icon_slot = -1;
+}
+
+bool StatusNotifierItem::select_icon_slot(int32_t index)
 {
-    if (!bus || title == current_title)
+    if (!bus || index < 0 || static_cast<size_t>(index) >= icon_slots.size())
+        return false;
+
+    if (index == current_icon_slot)
         return true;
 
-    current_title = title;
+    current_icon_slot = index;
+    show_icon_slot();
 
-    GError *error = nullptr;
-    gboolean result = g_dbus_connection_emit_signal(
-        bus.get(),
-        nullptr,
-        object_path.c_str(),
-        SNI_INTERFACE,
-        "NewTitle",
-        nullptr,
-        &error);
+    return true;
+}
 
-    if (!result || error)
-    {
-        GErrorPtr error_ptr(error);
+bool StatusNotifierItem::set_attention_icon_slot(int32_t index)
+{
+    if (!bus || index < 0 || static_cast<size_t>(index) >= icon_slots.size())
         return false;
-    }
 
-    return true;
+    attention_icon_slot = index;
+    return show_attention_icon_slot();
 }
 
-bool StatusNotifierItem::register_menu()
+bool StatusNotifierItem::set_badge_count(int32_t count)
 {
-    if (!bus || menu_registration_id != 0)
-    {
+    // Everything past 99 renders as "99+"
+    count = std::clamp(count, 0, 100);
+
+    if (!bus || count == badge_count)
         return true;
-    }
 
-    GError *error = nullptr;
+    badge_count = count;
 
-    static GDBusInterfaceVTable menu_vtable = {
-        handle_menu_method_call,
-        handle_menu_get_property,
-        nullptr,
-        {}
-    };
+    if (current_icon_slot >= 0)
+        show_icon_slot();
 
-    GDBusNodeInfo *node_info = g_dbus_node_info_new_for_xml(menu_introspection_xml, &error);
-    if (!node_info)
-    {
-        GErrorPtr error_ptr(error);
+    return attention_icon_slot < 0 || show_attention_icon_slot();
+}
+
+const IconSlot &StatusNotifierItem::badged_slot(int32_t index)
+{
+    const IconSlot &slot = icon_slots[index];
+    if (badge_count <= 0)
+        return slot;
+
+    auto key = std::make_pair(index, badge_count);
+    auto it = badge_cache.find(key);
+    if (it != badge_cache.end())
+        return it->second;
+
+    // Each entry holds a full mip chain, so keep only the counts seen recently
+    if (badge_cache.size() >= 32)
+        badge_cache.clear();
+
+    IconSlot badged;
+    badged.name = slot.name;
+
+    for (const auto &pixmap : slot.pixmaps)
+    {
+        gsize size;
+        const void *data = g_bytes_get_data(pixmap.argb32.get(), &size);
+
+        auto *copy = static_cast<uint8_t *>(g_malloc(size));
+        memcpy(copy, data, size);
+        draw_count_badge(copy, pixmap.width, pixmap.height, badge_count);
+
+        badged.pixmaps.push_back({pixmap.width, pixmap.height, GBytesPtr(g_bytes_new_take(copy, size))});
+    }
+
+    badged.pixmap.reset(g_variant_ref_sink(pixmaps_to_variant(badged.pixmaps)));
+    badged.hash = hash_pixmaps(badged.pixmap.get());
+
+    return badge_cache.emplace(key, std::move(badged)).first->second;
+}
+
+void StatusNotifierItem::show_icon_slot()
+{
+    if (!animation_frames.empty())
+        return;
+
+    const IconSlot &slot = badged_slot(current_icon_slot);
+
+    icon_pixmap.reset(g_variant_ref(slot.pixmap.get()));
+    queue_icon_update(slot.hash);
+}
+
+bool StatusNotifierItem::show_attention_icon_slot()
+{
+    const IconSlot &slot = badged_slot(attention_icon_slot);
+
+    if (attention_icon_pixmap.get() == slot.pixmap.get())
+        return true;
+
+    attention_icon_pixmap.reset(g_variant_ref(slot.pixmap.get()));
+
+    if (registered_with_watcher)
+        queue_update(PENDING_NEW_ATTENTION_ICON);
+
+    return true;
+}
+
+bool StatusNotifierItem::set_status(const std::string &status)
+{
+    if (status != "Active" && status != "Passive" && status != "NeedsAttention")
+        return false;
+
+    if (!bus || status == current_status)
+        return true;
+
+    current_status = status;
+
+    if (registered_with_watcher)
+        queue_update(PENDING_NEW_STATUS);
+
+    return true;
+}
+
+bool StatusNotifierItem::set_animation(std::vector<AnimationFrame> frames, bool loop)
+{
+    if (!bus || frames.empty())
+        return false;
+
+    for (auto &frame : frames)
+    {
+        if (frame.slot >= 0)
+        {
+            if (static_cast<size_t>(frame.slot) >= icon_slots.size())
+                return false;
+
+            frame.icon.pixmap.reset(g_variant_ref(icon_slots[frame.slot].pixmap.get()));
+            frame.icon.hash = icon_slots[frame.slot].hash;
+        }
+        else
+        {
+            if (frame.slot != -1 || !frame.icon.pixmap)
+                return false;
+
+            frame.icon.hash = hash_pixmaps(frame.icon.pixmap.get());
+        }
+
+        // Anything faster would only be merged away by the update rate cap
+        frame.duration_ms = std::max(frame.duration_ms, 16u);
+    }
+
+    if (animation_source)
+    {
+        g_source_destroy(animation_source);
+        g_source_unref(animation_source);
+        animation_source = nullptr;
+    }
+
+    animation_frames = std::move(frames);
+    animation_frame = 0;
+    animation_loop = loop;
+
+    show_animation_frame();
+    update_animation_timer();
+
+    return true;
+}
+
+void StatusNotifierItem::stop_animation()
+{
+    if (animation_frames.empty())
+        return;
+
+    if (animation_source)
+    {
+        g_source_destroy(animation_source);
+        g_source_unref(animation_source);
+        animation_source = nullptr;
+    }
+
+    animation_frames.clear();
+
+    if (current_icon_slot >= 0)
+    {
+        show_icon_slot();
+    }
+    else if (pixmap_icon.pixmap)
+    {
+        icon_pixmap.reset(g_variant_ref(pixmap_icon.pixmap.get()));
+        queue_icon_update(pixmap_icon.hash);
+    }
+}
+
+void StatusNotifierItem::show_animation_frame()
+{
+    const IconSlot &icon = animation_frames[animation_frame].icon;
+
+    icon_pixmap.reset(g_variant_ref(icon.pixmap.get()));
+    queue_icon_update(icon.hash);
+}
+
+void StatusNotifierItem::update_animation_timer()
+{
+    bool should_run = !animation_frames.empty() && registered_with_watcher;
+
+    if (should_run && !animation_source)
+    {
+        animation_source = g_timeout_source_new(animation_frames[animation_frame].duration_ms);
+        g_source_set_callback(animation_source, on_animation_timeout, this, nullptr);
+        g_source_attach(animation_source, context);
+    }
+    else if (!should_run && animation_source)
+    {
+        // Nobody is showing the icon, so pause on the current frame
+        g_source_destroy(animation_source);
+        g_source_unref(animation_source);
+        animation_source = nullptr;
+    }
+}
+
+gboolean StatusNotifierItem::on_animation_timeout(gpointer user_data)
+{
+    auto *self = static_cast<StatusNotifierItem *>(user_data);
+
+    g_source_unref(self->animation_source);
+    self->animation_source = nullptr;
+
+    if (self->animation_frame + 1 >= self->animation_frames.size() && !self->animation_loop)
+    {
+        self->stop_animation();
+        return G_SOURCE_REMOVE;
+    }
+
+    self->animation_frame = (self->animation_frame + 1) % self->animation_frames.size();
+    self->show_animation_frame();
+
+    // Frames have their own durations, so every frame gets a fresh timeout
+    self->update_animation_timer();
+
+    return G_SOURCE_REMOVE;
+}
+
+bool StatusNotifierItem::set_title(const std::string &title)
+{
+    if (!bus)
+        return true;
+
+    if (title == current_title)
+    {
+        stats.dropped++;
+        return true;
+    }
+
+    current_title = title;
+    queue_update(PENDING_NEW_TITLE);
+
+    return true;
+}
+
+void StatusNotifierItem::set_max_update_rate(double hz)
+{
+    // Also keeps the interval within what schedule_flush() can hand to a millisecond timeout
+    min_flush_interval = hz > 0 ? static_cast<gint64>(G_USEC_PER_SEC / std::max(hz, MIN_UPDATE_RATE_HZ)) : 0;
+}
+
+void StatusNotifierItem::begin_update()
+{
+    update_depth++;
+}
+
+void StatusNotifierItem::commit_update()
+{
+    if (update_depth == 0 || --update_depth > 0)
+        return;
+
+    if (pending_signals)
+        schedule_flush();
+}
+
+UpdateStats StatusNotifierItem::get_update_stats() const
+{
+    UpdateStats snapshot;
+    snapshot.emitted = stats.emitted.load(std::memory_order_relaxed);
+    snapshot.merged = stats.merged.load(std::memory_order_relaxed);
+    snapshot.dropped = stats.dropped.load(std::memory_order_relaxed);
+    snapshot.batches = stats.batches.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+void StatusNotifierItem::queue_icon_update(uint64_t hash)
+{
+    current_icon_hash = hash;
+
+    if (registered_with_watcher && !(pending_signals & PENDING_NEW_ICON) && hash == announced_icon_hash)
+    {
+        stats.dropped++;
+        return;
+    }
+
+    queue_update(PENDING_NEW_ICON);
+}
+
+void StatusNotifierItem::queue_update(uint32_t signal)
+{
+    if (pending_signals & signal)
+        stats.merged++;
+
+    pending_signals |= signal;
+
+    if (update_depth == 0)
+        schedule_flush();
+}
+
+void StatusNotifierItem::schedule_flush()
+{
+    if (flush_source)
+        return;
+
+    // The first update after a quiet period goes out once the current main loop iteration is done, so
+    // setters that have already reached this thread share its batch. One posted a moment later may miss
+    // it; begin_update() is the way to guarantee a single batch. Anything after that waits for the window.
+    gint64 wait = last_flush_time + min_flush_interval - g_get_monotonic_time();
+    if (wait <= 0)
+    {
+        flush_source = g_idle_source_new();
+    }
+    else
+    {
+        flush_source = g_timeout_source_new(static_cast<guint>((wait + 999) / 1000));
+    }
+
+    g_source_set_callback(flush_source, on_flush_timeout, this, nullptr);
+    g_source_attach(flush_source, context);
+}
+
+gboolean StatusNotifierItem::on_flush_timeout(gpointer user_data)
+{
+    auto *self = static_cast<StatusNotifierItem *>(user_data);
+
+    g_source_unref(self->flush_source);
+    self->flush_source = nullptr;
+
+    // A transaction opened after the flush was scheduled; commit_update() schedules it again
+    if (self->update_depth == 0)
+        self->flush_updates();
+
+    return G_SOURCE_REMOVE;
+}
+
+void StatusNotifierItem::flush_updates()
+{
+    uint32_t signals = pending_signals;
+    pending_signals = 0;
+    last_flush_time = g_get_monotonic_time();
+    uint64_t emitted_before = stats.emitted.load(std::memory_order_relaxed);
+
+    // Status first: hosts that hide Passive items shouldn't fetch an icon only to drop it
+    if (signals & PENDING_NEW_STATUS)
+    {
+        emit_signal(object_path, SNI_INTERFACE, "NewStatus", g_variant_new("(s)", current_status.c_str()));
+    }
+
+    if (signals & PENDING_NEW_ICON)
+    {
+        if (!registered_with_watcher)
+        {
+            // Registration is asynchronous and announces whatever is current once it completes
+            register_with_watcher();
+        }
+        else if (current_icon_hash == announced_icon_hash)
+        {
+            stats.dropped++;
+        }
+        else if (emit_signal(object_path, SNI_INTERFACE, "NewIcon", nullptr))
+        {
+            announced_icon_hash = current_icon_hash;
+        }
+    }
+
+    if (signals & PENDING_NEW_ATTENTION_ICON)
+    {
+        emit_signal(object_path, SNI_INTERFACE, "NewAttentionIcon", nullptr);
+    }
+
+    if (signals & PENDING_NEW_TITLE)
+    {
+        emit_signal(object_path, SNI_INTERFACE, "NewTitle", nullptr);
+    }
+
+    // A new layout makes hosts refetch every item, which covers any pending property updates as well
+    if (signals & PENDING_LAYOUT_UPDATED)
+    {
+        pending_menu_properties.clear();
+        emit_signal(menu_object_path, DBUSMENU_INTERFACE, "LayoutUpdated", g_variant_new("(ui)", menu_revision, 0));
+    }
+
+    if (signals & PENDING_MENU_PROPERTIES)
+    {
+        GVariantBuilder updated_builder;
+        g_variant_builder_init(&updated_builder, G_VARIANT_TYPE("a(ia{sv})"));
+        GVariantBuilder removed_builder;
+        g_variant_builder_init(&removed_builder, G_VARIANT_TYPE("a(ias)"));
+        bool any = false;
+
+        for (const auto &[id, properties] : pending_menu_properties)
+        {
+            // Items may have been dropped by a set_menu() while their update was pending
+            const MenuNode *node = menu.find(id);
+            if (!node)
+                continue;
+
+            // A property back at its default is removed rather than resent, so hosts fall back to the default
+            GVariantBuilder values;
+            g_variant_builder_init(&values, G_VARIANT_TYPE("a{sv}"));
+            GVariantBuilder names;
+            g_variant_builder_init(&names, G_VARIANT_TYPE("as"));
+            bool has_values = false, has_names = false;
+
+            for (uint32_t bit = 1; bit & MENU_PROPERTIES_ALL; bit <<= 1)
+            {
+                if (!(properties & bit))
+                    continue;
+
+                auto property = static_cast<MenuProperty>(bit);
+                if (GVariant *value = menu.property_value(*node, property))
+                {
+                    g_variant_builder_add(&values, "{sv}", menu_property_name(property), value);
+                    has_values = true;
+                }
+                else
+                {
+                    g_variant_builder_add(&names, "s", menu_property_name(property));
+                    has_names = true;
+                }
+            }
+
+            if (has_values)
+                g_variant_builder_add(&updated_builder, "(i@a{sv})", id, g_variant_builder_end(&values));
+            else
+                g_variant_builder_clear(&values);
+
+            if (has_names)
+                g_variant_builder_add(&removed_builder, "(i@as)", id, g_variant_builder_end(&names));
+            else
+                g_variant_builder_clear(&names);
+
+            any |= has_values || has_names;
+        }
+        pending_menu_properties.clear();
+
+        if (any)
+        {
+            emit_signal(menu_object_path, DBUSMENU_INTERFACE, "ItemsPropertiesUpdated",
+                g_variant_new("(@a(ia{sv})@a(ias))",
+                              g_variant_builder_end(&updated_builder),
+                              g_variant_builder_end(&removed_builder)));
+        }
+        else
+        {
+            g_variant_builder_clear(&updated_builder);
+            g_variant_builder_clear(&removed_builder);
+        }
+    }
+
+    if (stats.emitted.load(std::memory_order_relaxed) != emitted_before)
+        stats.batches++;
+}
+
+bool StatusNotifierItem::emit_signal(const std::string &path, const char *interface_name, const char *signal_name, GVariant *parameters)
+{
+    GError *error = nullptr;
+    gboolean result = g_dbus_connection_emit_signal(
+        bus.get(),
+        nullptr,
+        path.c_str(),
+        interface_name,
+        signal_name,
+        parameters,
+        &error);
+
+    if (!result || error)
+    {
+        GErrorPtr error_ptr(error);
+        return false;
+    }
+
+    stats.emitted++;
+    return true;
+}
+
+bool StatusNotifierItem::register_menu()
+{
+    if (!bus || menu_registration_id != 0)
+    {
+        return true;
+    }
+
+    GError *error = nullptr;
+
+    static GDBusInterfaceVTable menu_vtable = {
+        handle_menu_method_call,
+        handle_menu_get_property,
+        nullptr,
+        {}
+    };
+
+    GDBusNodeInfo *node_info = g_dbus_node_info_new_for_xml(menu_introspection_xml, &error);
+    if (!node_info)
+    {
+        GErrorPtr error_ptr(error);
         return false;
     }
 
@@ -760,98 +1343,295 @@ bool StatusNotifierItem::set_menu(const std::vector<MenuItem> &items)
     if (!bus)
         return false;
 
-    menu_items = items;
-    menu_revision++;
+    MenuChanges changes;
+    MenuSetResult result = menu.set(items, changes);
 
-    if (!register_menu())
+    if (result == MenuSetResult::Rejected)
     {
+        std::cerr << "[libvesktop::StatusNotifierItem] Menu rejected: item ids must be unique and non-zero, and menus "
+                  << "nested at most " << MenuModel::MAX_DEPTH << " levels deep" << std::endl;
         return false;
     }
 
-    GError *error = nullptr;
-    gboolean result = g_dbus_connection_emit_signal(
-        bus.get(),
-        nullptr,
-        menu_object_path.c_str(),
-        DBUSMENU_INTERFACE,
-        "LayoutUpdated",
-        g_variant_new("(ui)", menu_revision, 0),
-        &error);
+    menu_set = true;
 
-    if (!result || error)
+    if (!register_menu())
     {
-        GErrorPtr error_ptr(error);
         return false;
     }
 
+    // Hosts rebuild the whole menu on LayoutUpdated, so it is kept for changes that move items around;
+    // anything else goes out as the properties that differ
+    if (result == MenuSetResult::Layout)
+    {
+        menu_revision++;
+        queue_update(PENDING_LAYOUT_UPDATED);
+        return true;
+    }
+
+    if (changes.empty())
+    {
+        stats.dropped++;
+        return true;
+    }
+
+    for (const auto &[id, properties] : changes)
+        pending_menu_properties[id] |= properties;
+
+    layout.reset();
+    queue_update(PENDING_MENU_PROPERTIES);
     return true;
 }
 
-bool StatusNotifierItem::update_menu_item_label(int32_t id, const std::string &new_label)
+bool StatusNotifierItem::update_menu_items(const std::vector<MenuItemUpdate> &updates)
 {
     if (!bus)
         return false;
 
-    bool found = false;
-    for (auto &item : menu_items)
+    bool all_found = true;
+    bool changed = false;
+
+    for (const auto &update : updates)
     {
-        if (item.id == id)
+        if (!menu.find(update.id) || update.id == MenuModel::ROOT_ID)
         {
-            item.label = new_label;
-            found = true;
-            break;
+            all_found = false;
+            continue;
         }
+
+        if (!menu.update(update, pending_menu_properties))
+        {
+            stats.dropped++;
+            continue;
+        }
+
+        changed = true;
     }
 
-    if (!found)
-        return false;
+    if (changed)
+    {
+        // Property changes don't alter the layout's shape, so the revision stays; only the cached copy is stale
+        layout.reset();
+        queue_update(PENDING_MENU_PROPERTIES);
+    }
 
-    menu_revision++;
+    return all_found;
+}
 
-    GVariantBuilder updated_props_builder;
-    g_variant_builder_init(&updated_props_builder, G_VARIANT_TYPE("a(ia{sv})"));
+bool StatusNotifierItem::update_menu_item_label(int32_t id, const std::string &new_label)
+{
+    MenuItemUpdate update;
+    update.id = id;
+    update.label = new_label;
+    return update_menu_items({update});
+}
 
-    GVariantBuilder item_builder;
-    g_variant_builder_init(&item_builder, G_VARIANT_TYPE("(ia{sv})"));
-    g_variant_builder_add(&item_builder, "i", id);
+void StatusNotifierItem::handle_menu_clicks(const std::vector<std::pair<int32_t, uint32_t>> &clicks)
+{
+    bool toggled = false;
+    for (const auto &[id, timestamp] : clicks)
+        toggled |= menu.toggle(id, pending_menu_properties);
 
-    GVariantBuilder props_builder;
-    g_variant_builder_init(&props_builder, G_VARIANT_TYPE("a{sv}"));
-    g_variant_builder_add(&props_builder, "{sv}", "label", g_variant_new_string(new_label.c_str()));
+    // The host hears about the new toggle state before JS does, so the checkmark moves with the click
+    // rather than after a round trip through the JS thread
+    if (toggled)
+        flush_menu_properties();
 
-    g_variant_builder_add(&item_builder, "@a{sv}", g_variant_builder_end(&props_builder));
-    g_variant_builder_add(&updated_props_builder, "@(ia{sv})", g_variant_builder_end(&item_builder));
+    if (!menu_click_callback)
+        return;
 
-    GVariantBuilder removed_props_builder;
-    g_variant_builder_init(&removed_props_builder, G_VARIANT_TYPE("a(ias)"));
+    for (const auto &[id, timestamp] : clicks)
+    {
+        const MenuNode *node = menu.find(id);
+        bool is_toggle = node && node->item.toggle_type != MenuToggleType::None;
+        menu_click_callback(id, timestamp, is_toggle ? node->item.toggle_state : -1);
+    }
+}
 
-    GError *error = nullptr;
-    gboolean result = g_dbus_connection_emit_signal(
-        bus.get(),
-        nullptr,
-        menu_object_path.c_str(),
-        DBUSMENU_INTERFACE,
-        "ItemsPropertiesUpdated",
-        g_variant_new("(@a(ia{sv})@a(ias))",
-                      g_variant_builder_end(&updated_props_builder),
-                      g_variant_builder_end(&removed_props_builder)),
-        &error);
+void StatusNotifierItem::flush_menu_properties()
+{
+    layout.reset();
+    pending_signals |= PENDING_MENU_PROPERTIES;
 
-    if (!result || error)
+    if (update_depth == 0)
+        flush_updates();
+}
+
+void StatusNotifierItem::request_about_to_show(PendingAboutToShow request, int32_t id)
+{
+    about_to_show_pending.push_back(std::move(request));
+
+    // Without a provider the model is always current and every change has already been announced
+    if (!about_to_show_callback)
     {
-        GErrorPtr error_ptr(error);
-        return false;
+        answer_about_to_show(false);
+        return;
     }
 
-    return true;
+    // Hosts often open the root and a submenu back to back; one answer covers both
+    if (!about_to_show_requested)
+    {
+        if (!about_to_show_callback(id))
+        {
+            answer_about_to_show(false);
+            return;
+        }
+        about_to_show_requested = true;
+    }
+
+    if (!about_to_show_timeout)
+    {
+        about_to_show_timeout = g_timeout_source_new(ABOUT_TO_SHOW_TIMEOUT_MS);
+        g_source_set_callback(about_to_show_timeout, on_about_to_show_timeout, this, nullptr);
+        g_source_attach(about_to_show_timeout, context);
+    }
+}
+
+gboolean StatusNotifierItem::on_about_to_show_timeout(gpointer user_data)
+{
+    auto *self = static_cast<StatusNotifierItem *>(user_data);
+
+    std::cerr << "[libvesktop::StatusNotifierItem] Menu provider took longer than " << ABOUT_TO_SHOW_TIMEOUT_MS
+              << " ms, showing the menu as it is" << std::endl;
+
+    // about_to_show_requested stays set, so a late answer still lands and a slow JS thread isn't asked
+    // again until it has caught up
+    self->answer_about_to_show(false);
+
+    return G_SOURCE_REMOVE;
+}
+
+void StatusNotifierItem::answer_about_to_show(bool changed)
+{
+    if (about_to_show_timeout)
+    {
+        g_source_destroy(about_to_show_timeout);
+        g_source_unref(about_to_show_timeout);
+        about_to_show_timeout = nullptr;
+    }
+
+    for (PendingAboutToShow &request : about_to_show_pending)
+    {
+        if (!request.group)
+        {
+            g_dbus_method_invocation_return_value(request.invocation, g_variant_new("(b)", changed));
+            continue;
+        }
+
+        GVariantBuilder updates_builder;
+        g_variant_builder_init(&updates_builder, G_VARIANT_TYPE("ai"));
+        if (changed)
+        {
+            for (int32_t id : request.ids)
+                g_variant_builder_add(&updates_builder, "i", id);
+        }
+
+        GVariantBuilder errors_builder;
+        g_variant_builder_init(&errors_builder, G_VARIANT_TYPE("ai"));
+        for (int32_t id : request.id_errors)
+            g_variant_builder_add(&errors_builder, "i", id);
+
+        g_dbus_method_invocation_return_value(request.invocation,
+            g_variant_new("(@ai@ai)", g_variant_builder_end(&updates_builder), g_variant_builder_end(&errors_builder)));
+    }
+
+    about_to_show_pending.clear();
+}
+
+void StatusNotifierItem::provide_menu(const std::vector<MenuItemUpdate> &updates)
+{
+    about_to_show_requested = false;
+
+    bool changed = false;
+    for (const auto &update : updates)
+        changed |= menu.update(update, pending_menu_properties);
+
+    // Announced before the reply, so hosts that ignore needUpdate still show the new values
+    if (changed)
+        flush_menu_properties();
+
+    answer_about_to_show(changed);
 }
 
-void StatusNotifierItem::set_menu_click_callback(std::function<void(int32_t)> callback)
+void StatusNotifierItem::set_about_to_show_callback(std::function<bool(int32_t id)> callback)
+{
+    about_to_show_callback = callback;
+
+    if (!about_to_show_callback)
+    {
+        about_to_show_requested = false;
+        answer_about_to_show(false);
+    }
+}
+
+void StatusNotifierItem::set_menu_click_callback(std::function<void(int32_t id, uint32_t timestamp, int32_t toggle_state)> callback)
 {
     menu_click_callback = callback;
 }
 
-void StatusNotifierItem::set_activate_callback(std::function<void()> callback)
+void StatusNotifierItem::set_activate_callback(std::function<void(int32_t x, int32_t y)> callback)
 {
     activate_callback = callback;
 }
+
+void StatusNotifierItem::set_secondary_activate_callback(std::function<void(int32_t x, int32_t y)> callback)
+{
+    secondary_activate_callback = callback;
+}
+
+void StatusNotifierItem::set_context_menu_callback(std::function<void(int32_t x, int32_t y)> callback)
+{
+    context_menu_callback = callback;
+}
+
+void StatusNotifierItem::set_scroll_callback(std::function<void(int32_t horizontal, int32_t vertical)> callback)
+{
+    scroll_callback = callback;
+}
+
+void StatusNotifierItem::queue_scroll(int32_t delta, bool horizontal)
+{
+    (horizontal ? scroll_horizontal : scroll_vertical) += delta;
+
+    if (scroll_source)
+        return;
+
+    gint64 wait = last_scroll_time + SCROLL_INTERVAL - g_get_monotonic_time();
+    if (wait <= 0)
+    {
+        flush_scroll();
+        return;
+    }
+
+    scroll_source = g_timeout_source_new(static_cast<guint>((wait + 999) / 1000));
+    g_source_set_callback(scroll_source, on_scroll_timeout, this, nullptr);
+    g_source_attach(scroll_source, context);
+}
+
+gboolean StatusNotifierItem::on_scroll_timeout(gpointer user_data)
+{
+    auto *self = static_cast<StatusNotifierItem *>(user_data);
+
+    g_source_unref(self->scroll_source);
+    self->scroll_source = nullptr;
+    self->flush_scroll();
+
+    return G_SOURCE_REMOVE;
+}
+
+void StatusNotifierItem::flush_scroll()
+{
+    last_scroll_time = g_get_monotonic_time();
+
+    auto clamp = [](int64_t delta) {
+        return static_cast<int32_t>(std::clamp<int64_t>(delta, INT32_MIN, INT32_MAX));
+    };
+    int32_t horizontal = clamp(scroll_horizontal);
+    int32_t vertical = clamp(scroll_vertical);
+    scroll_horizontal = 0;
+    scroll_vertical = 0;
+
+    // Back-and-forth that cancels out within a frame isn't worth a callback
+    if ((horizontal || vertical) && scroll_callback)
+        scroll_callback(horizontal, vertical);
+}
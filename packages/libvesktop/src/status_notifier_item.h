@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <gio/gio.h>
 #include <memory>
@@ -7,27 +8,39 @@
 #include <vector>
 #include <map>
 #include <functional>
+#include "glib_ptr.h"
+#include "menu_model.h"
+#include "pixmap.h"
+#include "session_bus.h"
 
-template <typename T>
-struct GObjectDeleter
+// A prebuilt IconPixmap that can be switched to without touching pixel data
+struct IconSlot
 {
-    void operator()(T *obj) const
-    {
-        if (obj)
-            g_object_unref(obj);
-    }
+    std::string name;
+    // Source sizes, kept so badges can be composited without asking JS for pixels again
+    std::vector<Pixmap> pixmaps;
+    GVariantPtr pixmap;
+    uint64_t hash = 0;
 };
 
-template <typename T>
-using GObjectPtr = std::unique_ptr<T, GObjectDeleter<T>>;
+struct AnimationFrame
+{
+    // Either an existing slot index or a frame-specific icon in `icon`
+    int32_t slot = -1;
+    IconSlot icon;
+    guint duration_ms = 0;
+};
 
-struct MenuItem
+struct UpdateStats
 {
-    int32_t id;
-    std::string label;
-    bool enabled;
-    bool visible;
-    bool is_separator;
+    // Signals actually sent to the bus
+    uint64_t emitted = 0;
+    // Updates folded into a signal that was already pending
+    uint64_t merged = 0;
+    // Updates that changed nothing hosts can see (same icon content, same title or label)
+    uint64_t dropped = 0;
+    // Flushes that sent at least one signal; each is one state change as far as hosts can tell
+    uint64_t batches = 0;
 };
 
 class StatusNotifierItem
@@ -36,22 +49,118 @@ private:
     GObjectPtr<GDBusConnection> bus;
     guint registration_id = 0;
     guint menu_registration_id = 0;
+    guint owner_id = 0;
+    // Name watch on the StatusNotifierWatcher; registration is redone whenever a new watcher appears
     guint watcher_id = 0;
+    bool watcher_present = false;
+    // Whether the objects, name and watch are up on `bus`
+    bool exported = false;
+    // Whether set_menu() has been called, so the menu object is exported again after a reconnect
+    bool menu_set = false;
+    // Session bus listener that moves the item onto each new connection
+    guint bus_listener_id = 0;
+    // Retries an export that failed on the current connection
+    GSource *reexport_source = nullptr;
     bool registered_with_watcher = false;
+    // Set while a RegisterStatusNotifierItem call is in flight
+    GObjectPtr<GCancellable> registration_cancellable;
+    uint64_t registering_icon_hash = 0;
     std::string service_name;
     std::string object_path;
     std::string menu_object_path = "/MenuBar";
     std::string current_status = "Active";
     std::string current_icon_path;
     std::string current_title = "DogCord";
-    std::vector<uint8_t> current_icon_pixmap;
-    std::vector<MenuItem> menu_items;
+    // IconPixmap reply, built once per icon change and handed out by reference on every Get
+    GVariantPtr icon_pixmap;
+    GVariantPtr attention_icon_pixmap;
+    std::vector<IconSlot> icon_slots;
+    int32_t current_icon_slot = -1;
+    // Last set_icon_pixmap() icon, shown again when an animation stops with no slot selected
+    IconSlot pixmap_icon;
+    int32_t attention_icon_slot = -1;
+    int32_t badge_count = 0;
+    // Badged variants of slots keyed by (slot, count), built on first use
+    std::map<std::pair<int32_t, int32_t>, IconSlot> badge_cache;
+    MenuModel menu;
     uint32_t menu_revision = 1;
-    std::function<void(int32_t)> menu_click_callback;
-    std::function<void()> activate_callback;
+    // Serialized full layout for layout_revision; hosts call GetLayout on every open, the menu changes rarely
+    GVariantPtr layout;
+    uint32_t layout_revision = 0;
+    // Called on the item's thread; timestamp is the host's dbusmenu event time. toggle_state is the
+    // item's state after the click (0 or 1), or -1 if it isn't a checkmark or radio item.
+    std::function<void(int32_t id, uint32_t timestamp, int32_t toggle_state)> menu_click_callback;
+    std::function<void(int32_t x, int32_t y)> activate_callback;
+    std::function<void(int32_t x, int32_t y)> secondary_activate_callback;
+    std::function<void(int32_t x, int32_t y)> context_menu_callback;
+    std::function<void(int32_t horizontal, int32_t vertical)> scroll_callback;
+
+    // A wheel spin is dozens of Scroll calls; deltas are summed per orientation and handed on at most once
+    // per SCROLL_INTERVAL, leading edge first
+    static constexpr gint64 SCROLL_INTERVAL = G_USEC_PER_SEC / 60;
+    int64_t scroll_horizontal = 0;
+    int64_t scroll_vertical = 0;
+    GSource *scroll_source = nullptr;
+    gint64 last_scroll_time = 0;
+
+    // An AboutToShow or AboutToShowGroup call waiting for the menu provider
+    struct PendingAboutToShow
+    {
+        GDBusMethodInvocation *invocation;
+        // Empty for AboutToShow; AboutToShowGroup replies per id
+        std::vector<int32_t> ids;
+        std::vector<int32_t> id_errors;
+        bool group = false;
+    };
+    // Set when JS fills the menu in on demand. Called at most once per provide_menu() answer, however
+    // many hosts open the menu in the meantime; returns false if the request couldn't be passed on.
+    std::function<bool(int32_t id)> about_to_show_callback;
+    bool about_to_show_requested = false;
+    std::vector<PendingAboutToShow> about_to_show_pending;
+    GSource *about_to_show_timeout = nullptr;
+
+    // Update coalescing: setters only mark signals as pending, flush_updates() sends them at most once per window
+    static constexpr uint32_t PENDING_NEW_ICON = 1 << 0;
+    static constexpr uint32_t PENDING_NEW_TITLE = 1 << 1;
+    static constexpr uint32_t PENDING_MENU_PROPERTIES = 1 << 2;
+    static constexpr uint32_t PENDING_NEW_STATUS = 1 << 3;
+    static constexpr uint32_t PENDING_NEW_ATTENTION_ICON = 1 << 4;
+    static constexpr uint32_t PENDING_LAYOUT_UPDATED = 1 << 5;
+
+    GMainContext *context;
+
+    // Animation frames are advanced by a timeout on `context` and only tick while a watcher is registered
+    std::vector<AnimationFrame> animation_frames;
+    size_t animation_frame = 0;
+    bool animation_loop = true;
+    GSource *animation_source = nullptr;
+
+    GSource *flush_source = nullptr;
+    uint32_t pending_signals = 0;
+    // MenuProperty bits changed per item since the last ItemsPropertiesUpdated
+    std::map<int32_t, uint32_t> pending_menu_properties;
+    uint64_t current_icon_hash = 0;
+    uint64_t announced_icon_hash = 0;
+    gint64 last_flush_time = 0;
+    gint64 min_flush_interval = G_USEC_PER_SEC / 30;
+    // Open begin_update() calls; nothing is flushed while non-zero
+    uint32_t update_depth = 0;
+    // Written on the item's thread, read from JS through get_update_stats()
+    struct
+    {
+        std::atomic<uint64_t> emitted{0};
+        std::atomic<uint64_t> merged{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> batches{0};
+    } stats;
 
     static constexpr const char *WATCHER_SERVICE = "org.kde.StatusNotifierWatcher";
     static constexpr const char *WATCHER_PATH = "/StatusNotifierWatcher";
+    // A registration that takes longer is dropped and retried on the next icon change or watcher restart
+    static constexpr int WATCHER_TIMEOUT_MS = 10000;
+    // How long a host opening the menu waits on the provider before getting the menu as it is
+    static constexpr guint ABOUT_TO_SHOW_TIMEOUT_MS = 100;
+    static constexpr guint REEXPORT_RETRY_S = 2;
     static constexpr const char *SNI_INTERFACE = "org.kde.StatusNotifierItem";
     static constexpr const char *DBUSMENU_INTERFACE = "com.canonical.dbusmenu";
 
@@ -96,18 +205,88 @@ private:
         GError **error,
         gpointer user_data);
 
-    bool register_with_watcher();
+    // Exports the objects, owns the name and watches for the watcher on `bus`
+    bool export_on_bus();
+    // Undoes export_on_bus(), however far it got
+    void unexport();
+    // Moves the item onto the shared connection if it was replaced, or finishes a failed export
+    void reexport();
+    static gboolean on_reexport_retry(gpointer user_data);
+    void register_with_watcher();
+    static void on_register_reply(GObject *source, GAsyncResult *result, gpointer user_data);
+    static void on_watcher_appeared(GDBusConnection *connection, const gchar *name, const gchar *name_owner, gpointer user_data);
+    static void on_watcher_vanished(GDBusConnection *connection, const gchar *name, gpointer user_data);
+    const IconSlot &badged_slot(int32_t index);
+    void show_icon_slot();
+    bool show_attention_icon_slot();
+    void show_animation_frame();
+    void update_animation_timer();
+    static gboolean on_animation_timeout(gpointer user_data);
+    void queue_icon_update(uint64_t hash);
+    void queue_update(uint32_t signal);
+    void schedule_flush();
+    void flush_updates();
+    static gboolean on_flush_timeout(gpointer user_data);
+    bool emit_signal(const std::string &path, const char *interface_name, const char *signal_name, GVariant *parameters);
     bool register_menu();
+    // Flips toggle items natively and announces them right away, then reports each click
+    void handle_menu_clicks(const std::vector<std::pair<int32_t, uint32_t>> &clicks);
+    // Sends pending menu property changes now rather than on the next flush, unless a transaction is open
+    void flush_menu_properties();
+    void request_about_to_show(PendingAboutToShow request, int32_t id);
+    void answer_about_to_show(bool changed);
+    static gboolean on_about_to_show_timeout(gpointer user_data);
+    void queue_scroll(int32_t delta, bool horizontal);
+    void flush_scroll();
+    static gboolean on_scroll_timeout(gpointer user_data);
 
 public:
     StatusNotifierItem();
     ~StatusNotifierItem();
 
     bool initialize();
-    bool set_icon_pixmap(const std::vector<uint8_t> &pixmap_data);
+    // pixmap is an `a(iiay)` variant, usually one entry per size in ICON_PIXMAP_SIZES
+    bool set_icon_pixmap(GVariant *pixmap);
+    void set_icon_slots(std::vector<IconSlot> slots);
+    bool select_icon_slot(int32_t index);
+    // Icon hosts show instead of IconPixmap while the status is NeedsAttention
+    bool set_attention_icon_slot(int32_t index);
+    // Plays frames in place of the selected slot until stop_animation(); slot changes made meanwhile apply afterwards
+    bool set_animation(std::vector<AnimationFrame> frames, bool loop);
+    void stop_animation();
+    // Draws the unread count onto the selected and attention slots; 0 removes the badge
+    bool set_badge_count(int32_t count);
+    // One of "Active", "Passive" or "NeedsAttention"
+    bool set_status(const std::string &status);
     bool set_title(const std::string &title);
     bool set_menu(const std::vector<MenuItem> &items);
     bool update_menu_item_label(int32_t id, const std::string &new_label);
-    void set_menu_click_callback(std::function<void(int32_t)> callback);
-    void set_activate_callback(std::function<void()> callback);
+    // Applies every update, then announces the changed properties in a single ItemsPropertiesUpdated.
+    // Returns false if any id wasn't in the menu.
+    bool update_menu_items(const std::vector<MenuItemUpdate> &updates);
+    // Slowest cap set_max_update_rate() accepts, i.e. at most 10 s between flushes
+    static constexpr double MIN_UPDATE_RATE_HZ = 0.1;
+    // Caps how often queued signals are flushed to the bus; 0 disables the cap. Rates below
+    // MIN_UPDATE_RATE_HZ are raised to it.
+    void set_max_update_rate(double hz);
+    // Holds back every signal until the matching commit_update(), so a change spanning several
+    // setters reaches hosts as one batch. Calls nest.
+    void begin_update();
+    void commit_update();
+    // Safe to call from any thread
+    UpdateStats get_update_stats() const;
+    void set_menu_click_callback(std::function<void(int32_t id, uint32_t timestamp, int32_t toggle_state)> callback);
+    void set_activate_callback(std::function<void(int32_t x, int32_t y)> callback);
+    // Usually a middle click
+    void set_secondary_activate_callback(std::function<void(int32_t x, int32_t y)> callback);
+    // Only sent by hosts that don't show the dbusmenu themselves
+    void set_context_menu_callback(std::function<void(int32_t x, int32_t y)> callback);
+    // Summed deltas since the last call; one of them may be 0
+    void set_scroll_callback(std::function<void(int32_t horizontal, int32_t vertical)> callback);
+    // With a callback set, AboutToShow is held until provide_menu() answers it (or the timeout passes);
+    // without one it is answered at once. Clearing the callback answers anything still waiting.
+    void set_about_to_show_callback(std::function<bool(int32_t id)> callback);
+    // The provider's answer: applies whatever differs from the model, announces it and replies to the
+    // waiting hosts
+    void provide_menu(const std::vector<MenuItemUpdate> &updates);
 };
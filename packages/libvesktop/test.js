@@ -1,7 +1,7 @@
 /**
- * @type {typeof import(".")}
+ * @type {typeof import("./testing")}
  */
-const libVesktop = require(".");
+const libVesktop = require("./build/Release/libvesktop_testing.node");
 const test = require("node:test");
 const assert = require("node:assert/strict");
 
@@ -16,7 +16,133 @@ test("updateUnityLauncherCount should return true (success)", () => {
     assert.strictEqual(libVesktop.updateUnityLauncherCount(10), true);
 });
 
+test("setUnityLauncherProgress should validate its argument", () => {
+    assert.strictEqual(libVesktop.setUnityLauncherProgress(0.5), true);
+    assert.strictEqual(libVesktop.setUnityLauncherProgress(null), true);
+    assert.throws(() => libVesktop.setUnityLauncherProgress(1.5), RangeError);
+    assert.strictEqual(libVesktop.setUnityLauncherUrgent(false), true);
+});
+
 test("requestBackground should return true (success)", () => {
     assert.strictEqual(libVesktop.requestBackground(true, ["bash"]), true);
     assert.strictEqual(libVesktop.requestBackground(false, []), true);
 });
+
+test("getAccentColorAsync should resolve to the same color as getAccentColor", async () => {
+    assert.strictEqual(await libVesktop.getAccentColorAsync({ timeout: 2000 }), libVesktop.getAccentColor());
+});
+
+test("watchAppearance should resolve to the cached appearance", async () => {
+    const appearance = await libVesktop.watchAppearance();
+    assert.deepStrictEqual(libVesktop.getAppearance(), appearance);
+    assert.strictEqual(appearance.accentColor, libVesktop.getAccentColor());
+});
+
+test("async portal calls should reject with AbortError when aborted", async () => {
+    await assert.rejects(libVesktop.requestBackgroundAsync(true, ["bash"], { signal: AbortSignal.abort() }), {
+        name: "AbortError"
+    });
+    assert.throws(() => libVesktop.getAccentColorAsync({ timeout: -1 }), RangeError);
+});
+
+function jsBitmapToPixmap(bitmap, width, height) {
+    const pixmap = Buffer.alloc(8 + bitmap.length);
+    pixmap.writeUInt32LE(width, 0);
+    pixmap.writeUInt32LE(height, 4);
+
+    for (let i = 0; i < bitmap.length; i += 4) {
+        const alpha = bitmap[i + 3] / 255;
+        pixmap[8 + i] = bitmap[i + 3];
+        pixmap[8 + i + 1] = Math.round(bitmap[i + 2] * alpha);
+        pixmap[8 + i + 2] = Math.round(bitmap[i + 1] * alpha);
+        pixmap[8 + i + 3] = Math.round(bitmap[i] * alpha);
+    }
+
+    return pixmap;
+}
+
+test("bitmapToPixmap should match the JS premultiply loop for every color/alpha pair", () => {
+    // 256x256 covers all (channel, alpha) combinations; 255 and 7 pixel rows exercise the SIMD tails
+    for (const width of [256, 255, 7]) {
+        const height = 256;
+        const bitmap = Buffer.alloc(width * height * 4);
+        for (let i = 0; i < width * height; i++) {
+            bitmap[i * 4] = i & 0xff;
+            bitmap[i * 4 + 1] = 255 - (i & 0xff);
+            bitmap[i * 4 + 2] = (i * 7) & 0xff;
+            bitmap[i * 4 + 3] = (i >> 8) & 0xff;
+        }
+
+        assert.deepStrictEqual(libVesktop.bitmapToPixmap(bitmap, width, height), jsBitmapToPixmap(bitmap, width, height));
+    }
+});
+
+test("bitmapToPixmap should honor the row stride", () => {
+    const bitmap = Buffer.alloc(3 * 16 * 4 + 2 * 8);
+    bitmap.fill(0x80);
+
+    const packed = Buffer.alloc(3 * 16 * 4, 0x80);
+    assert.deepStrictEqual(libVesktop.bitmapToPixmap(bitmap, 16, 3, 16 * 4 + 8), jsBitmapToPixmap(packed, 16, 3));
+    assert.throws(() => libVesktop.bitmapToPixmap(bitmap, 16, 4, 16 * 4 + 8), RangeError);
+});
+
+test("diffMenuModel should send property-only changes as properties", () => {
+    const menu = [
+        { id: 1, label: "Open" },
+        { id: 2, label: "Restart arRPC", visible: false }
+    ];
+
+    assert.deepStrictEqual(libVesktop.diffMenuModel(menu, [{ id: 1, label: "Hide" }, menu[1]]), {
+        result: "properties",
+        changes: { 1: { label: "Hide" } }
+    });
+    // Back at the default, so hosts are told to remove it rather than sent a value
+    assert.deepStrictEqual(libVesktop.diffMenuModel(menu, [menu[0], { id: 2, label: "Restart arRPC" }]), {
+        result: "properties",
+        changes: { 2: { visible: null } }
+    });
+    assert.deepStrictEqual(libVesktop.diffMenuModel(menu, menu), { result: "properties", changes: {} });
+});
+
+test("diffMenuModel should send structural changes as a new layout", () => {
+    const menu = [{ id: 1, label: "Open" }, { id: 2, label: "About" }, { id: 3, label: "Quit" }];
+    const layout = next => libVesktop.diffMenuModel(menu, next).result;
+
+    assert.strictEqual(layout([menu[1], menu[0], menu[2]]), "layout");
+    assert.strictEqual(layout([...menu, { id: 4, label: "Restart" }]), "layout");
+    assert.strictEqual(layout([menu[0], menu[2]]), "layout");
+    assert.strictEqual(layout([menu[0], { ...menu[1], submenu: [menu[2]] }]), "layout");
+});
+
+test("diffMenuModel should reject bad ids", () => {
+    const menu = [{ id: 1, label: "Open" }];
+
+    assert.strictEqual(libVesktop.diffMenuModel(menu, [{ id: 0, label: "Root" }]).result, "rejected");
+    assert.strictEqual(libVesktop.diffMenuModel(menu, [{ id: 1, label: "Open" }, { id: 1, label: "Again" }]).result, "rejected");
+    // A child can't reuse its parent's id
+    assert.strictEqual(libVesktop.diffMenuModel(menu, [{ id: 1, submenu: [{ id: 1 }] }]).result, "rejected");
+    assert.throws(() => libVesktop.diffMenuModel(menu, [{ label: "No id" }]), TypeError);
+
+    const loop = [{ id: 1, submenu: [] }];
+    loop[0].submenu = loop;
+    assert.throws(() => libVesktop.diffMenuModel(menu, loop), RangeError);
+});
+
+test("clickMenuModel should keep one radio item per parent on", () => {
+    const menu = [
+        { id: 1, toggleType: "radio", checked: true },
+        { id: 2, toggleType: "radio" },
+        { id: 3, toggleType: "radio" },
+        { id: 4, submenu: [{ id: 5, toggleType: "radio", checked: true }] },
+        { id: 6, toggleType: "checkmark", checked: true },
+        { id: 7, toggleType: "checkmark", enabled: false }
+    ];
+
+    assert.deepStrictEqual(libVesktop.clickMenuModel(menu, 2), {
+        1: { "toggle-state": 0 },
+        2: { "toggle-state": 1 }
+    });
+    assert.deepStrictEqual(libVesktop.clickMenuModel(menu, 1), {});
+    assert.deepStrictEqual(libVesktop.clickMenuModel(menu, 6), { 6: { "toggle-state": 0 } });
+    assert.deepStrictEqual(libVesktop.clickMenuModel(menu, 7), {});
+});
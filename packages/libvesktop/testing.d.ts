@@ -0,0 +1,31 @@
+// Extra exports of the libvesktop_testing target (LIBVESKTOP_TESTING=1 npm run build), which test.js and
+// bench.js load in place of the addon itself
+
+import type { MenuItem } from ".";
+
+export * from ".";
+
+/**
+ * µs per GetLayout reply for a menu of itemCount items: rebuilt, from the layout cache, and filtered to
+ * the "visible" property. Used by bench.js.
+ */
+export function benchmarkMenuLayout(
+    itemCount: number,
+    iterations: number
+): { rebuild: number; cached: number; filtered: number };
+/**
+ * Properties that changed per item id. null means the property went back to its default and hosts are
+ * told to remove it.
+ */
+export type MenuModelChanges = Record<number, Record<string, string | number | boolean | null>>;
+/**
+ * Sets current, then next, on a menu model without a tray, and reports what setStatusNotifierMenu would
+ * announce for next: a new layout, only the changed properties, or nothing because next was rejected.
+ * Used by the tests.
+ */
+export function diffMenuModel(
+    current: MenuItem[],
+    next: MenuItem[]
+): { result: "rejected" | "properties" | "layout"; changes: MenuModelChanges };
+/** The properties a host is sent when item id of items is clicked. Used by the tests. */
+export function clickMenuModel(items: MenuItem[], id: number): MenuModelChanges;
@@ -52,6 +52,7 @@ export function setBadgeCount(count: number) {
         case "linux":
             // if (count === -1) count = 0;
             updateUnityLauncherCount(count);
+            AppEvents.emit("setTrayBadgeCount", count);
             break;
         case "darwin":
             if (count === 0) {
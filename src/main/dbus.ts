@@ -5,6 +5,7 @@
  */
 
 import { app } from "electron";
+import type { Appearance, PortalCallOptions } from "libvesktop";
 import { join } from "path";
 import { STATIC_DIR } from "shared/paths";
 
@@ -22,8 +23,12 @@ function loadLibVesktop() {
     return libVesktop;
 }
 
-export function getAccentColor() {
-    return loadLibVesktop()?.getAccentColor() ?? null;
+export async function getAccentColor(options?: PortalCallOptions) {
+    return (await loadLibVesktop()?.getAccentColorAsync(options)) ?? null;
+}
+
+export function watchAppearance(callback: (appearance: Appearance) => void) {
+    return loadLibVesktop()?.watchAppearance(callback) ?? Promise.resolve(null);
 }
 
 export function updateUnityLauncherCount(count: number) {
@@ -35,6 +40,16 @@ export function updateUnityLauncherCount(count: number) {
     return libVesktop.updateUnityLauncherCount(count);
 }
 
-export function requestBackground(autoStart: boolean, commandLine: string[]) {
-    return loadLibVesktop()?.requestBackground(autoStart, commandLine) ?? false;
+export function setLauncherProgress(progress: number | null) {
+    if (process.platform !== "linux") return;
+
+    loadLibVesktop()?.setUnityLauncherProgress(progress);
+}
+
+export async function requestBackground(autoStart: boolean, commandLine: string[], options?: PortalCallOptions) {
+    return (await loadLibVesktop()?.requestBackgroundAsync(autoStart, commandLine, options)) ?? false;
+}
+
+export function isSessionBusConnected() {
+    return loadLibVesktop()?.isSessionBusConnected() ?? false;
 }
@@ -12,5 +12,6 @@ export const AppEvents = new EventEmitter<{
     appLoaded: [];
     userAssetChanged: [UserAssetType];
     setTrayVariant: ["tray" | "trayUnread" | "traySpeaking" | "trayIdle" | "trayMuted" | "trayDeafened"];
+    setTrayBadgeCount: [number];
     voiceCallStateChanged: [boolean];
 }>();
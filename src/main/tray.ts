@@ -6,6 +6,7 @@
 
 import { app, BrowserWindow, Menu, NativeImage, nativeImage, Tray } from "electron";
 import { join } from "path";
+import { IpcEvents } from "shared/IpcEvents";
 import { STATIC_DIR } from "shared/paths";
 
 import { createAboutWindow } from "./about";
@@ -16,7 +17,8 @@ import { resolveAssetPath, UserAssetType } from "./userAssets";
 import { clearData } from "./utils/clearData";
 import { downloadVencordAsar } from "./utils/vencordLoader";
 
-type TrayVariant = "tray" | "trayUnread" | "traySpeaking" | "trayIdle" | "trayMuted" | "trayDeafened";
+const trayVariants = ["tray", "trayUnread", "traySpeaking", "trayIdle", "trayMuted", "trayDeafened"] as const;
+type TrayVariant = (typeof trayVariants)[number];
 
 const isLinux = process.platform === "linux";
 
@@ -34,8 +36,6 @@ let trayVariant: TrayVariant = "tray";
 let onTrayClick: (() => void) | null = null;
 let trayUpdateTimeout: NodeJS.Timeout | null = null;
 let pendingTrayVariant: TrayVariant | null = null;
-let nativeTrayWindow: BrowserWindow | null = null;
-let nativeTrayUpdateCallback: (() => void) | null = null;
 
 const trayImageCache = new Map<string, NativeImage>();
 
@@ -54,42 +54,49 @@ async function getCachedTrayImage(variant: TrayVariant): Promise<NativeImage> {
     return image;
 }
 
-function nativeImageToPixmap(image: NativeImage): Promise<Buffer> {
-    return new Promise(resolve => {
-        setImmediate(() => {
-            const resized = image.resize({ width: 32, height: 32 });
-            const size = resized.getSize();
-            const { width } = size;
-            const { height } = size;
-
-            const bitmap = resized.toBitmap();
-
-            const pixmapSize = 8 + bitmap.length;
-            const pixmap = Buffer.allocUnsafe(pixmapSize);
-
-            pixmap.writeUInt32LE(width, 0);
-            pixmap.writeUInt32LE(height, 4);
-
-            for (let i = 0; i < bitmap.length; i += 4) {
-                const r = bitmap[i];
-                const g = bitmap[i + 1];
-                const b = bitmap[i + 2];
-                const a = bitmap[i + 3];
-
-                const alpha = a / 255;
-                const premultR = Math.round(r * alpha);
-                const premultG = Math.round(g * alpha);
-                const premultB = Math.round(b * alpha);
-
-                pixmap[8 + i] = a;
-                pixmap[8 + i + 1] = premultB;
-                pixmap[8 + i + 2] = premultG;
-                pixmap[8 + i + 3] = premultR;
-            }
+// Hands every variant to libvesktop once, so switching variants later is just an index swap
+async function registerNativeTraySlots() {
+    const slots = await Promise.all(
+        trayVariants.map(async name => {
+            const image = await getCachedTrayImage(name);
+            const { width, height } = image.getSize();
+            return { name, bitmap: image.toBitmap(), width, height };
+        })
+    );
+    if (!nativeTrayInitialized) return;
+
+    nativeSNI!.registerStatusNotifierIconSlots(slots);
+    nativeSNI!.setStatusNotifierAttentionIconSlot(trayVariants.indexOf("trayUnread"));
+}
 
-            resolve(pixmap);
-        });
-    });
+// Slot and status are two setters, so they need a transaction to reach hosts as one change
+function applyNativeTrayVariant(variant: TrayVariant) {
+    nativeSNI!.beginStatusNotifierUpdate();
+    try {
+        // Unread is shown through the NeedsAttention status, hosts already hold the attention icon
+        if (variant === "trayUnread") {
+            nativeSNI!.selectStatusNotifierIconSlot(trayVariants.indexOf("tray"));
+            nativeSNI!.setStatusNotifierStatus("NeedsAttention");
+        } else {
+            nativeSNI!.selectStatusNotifierIconSlot(trayVariants.indexOf(variant));
+            nativeSNI!.setStatusNotifierStatus("Active");
+        }
+    } finally {
+        nativeSNI!.commitStatusNotifierUpdate();
+    }
+}
+
+// Slot registration awaits image loading, so without a transaction hosts could see the new slots
+// and the re-applied variant as separate changes
+async function refreshNativeTraySlots() {
+    nativeSNI!.beginStatusNotifierUpdate();
+    try {
+        await registerNativeTraySlots();
+        if (nativeTrayInitialized) applyNativeTrayVariant(trayVariant);
+    } finally {
+        // The tray may have been destroyed during the await, taking the open transaction with it
+        if (nativeTrayInitialized) nativeSNI!.commitStatusNotifierUpdate();
+    }
 }
 
 const userAssetChangedListener = async (asset: string) => {
@@ -97,9 +104,7 @@ const userAssetChangedListener = async (asset: string) => {
 
     if (useNativeTray && nativeSNI) {
         trayImageCache.clear();
-        const image = await getCachedTrayImage(trayVariant);
-        const pixmap = await nativeImageToPixmap(image);
-        nativeSNI.setStatusNotifierIcon(pixmap);
+        await refreshNativeTraySlots();
     } else if (tray) {
         trayImageCache.clear();
         const image = await getCachedTrayImage(trayVariant);
@@ -113,9 +118,7 @@ async function updateTrayIconNative(variant: TrayVariant) {
     trayVariant = variant;
 
     if (useNativeTray && nativeSNI) {
-        const image = await getCachedTrayImage(variant);
-        const pixmap = await nativeImageToPixmap(image);
-        nativeSNI.setStatusNotifierIcon(pixmap);
+        applyNativeTrayVariant(variant);
     }
 }
 
@@ -148,6 +151,13 @@ const setTrayVariantListener = (variant: TrayVariant) => {
     }
 };
 
+// Only the native tray can draw counts, the Electron fallback keeps using the static unread icon
+const setTrayBadgeCountListener = (count: number) => {
+    if (useNativeTray && nativeSNI) {
+        nativeSNI.setStatusNotifierBadgeCount(count);
+    }
+};
+
 if (!AppEvents.listeners("userAssetChanged").includes(userAssetChangedListener)) {
     AppEvents.on("userAssetChanged", userAssetChangedListener);
 }
@@ -156,9 +166,14 @@ if (!AppEvents.listeners("setTrayVariant").includes(setTrayVariantListener)) {
     AppEvents.on("setTrayVariant", setTrayVariantListener);
 }
 
+if (!AppEvents.listeners("setTrayBadgeCount").includes(setTrayBadgeCountListener)) {
+    AppEvents.on("setTrayBadgeCount", setTrayBadgeCountListener);
+}
+
 export function destroyTray() {
     AppEvents.off("userAssetChanged", userAssetChangedListener);
     AppEvents.off("setTrayVariant", setTrayVariantListener);
+    AppEvents.off("setTrayBadgeCount", setTrayBadgeCountListener);
 
     if (trayUpdateTimeout) {
         clearTimeout(trayUpdateTimeout);
@@ -168,12 +183,6 @@ export function destroyTray() {
 
     if (useNativeTray && nativeSNI) {
         try {
-            if (nativeTrayWindow && nativeTrayUpdateCallback) {
-                nativeTrayWindow.off("show", nativeTrayUpdateCallback);
-                nativeTrayWindow.off("hide", nativeTrayUpdateCallback);
-                nativeTrayWindow = null;
-                nativeTrayUpdateCallback = null;
-            }
             nativeSNI.destroyStatusNotifierItem();
             nativeTrayInitialized = false;
         } catch (e) {
@@ -201,14 +210,12 @@ export async function initTray(win: BrowserWindow, setIsQuitting: (val: boolean)
 
     if (isLinux && nativeSNI) {
         try {
-            const success = nativeSNI.initStatusNotifierItem();
+            const success = await nativeSNI.initStatusNotifierItem();
             if (success) {
                 useNativeTray = true;
                 nativeTrayInitialized = true;
 
-                const initialImage = await getCachedTrayImage(trayVariant);
-                const pixmap = await nativeImageToPixmap(initialImage);
-                nativeSNI.setStatusNotifierIcon(pixmap);
+                await refreshNativeTraySlots();
                 nativeSNI.setStatusNotifierTitle("Dog Cord");
 
                 const menuItems = [
@@ -229,13 +236,12 @@ export async function initTray(win: BrowserWindow, setIsQuitting: (val: boolean)
 
                 const menuResult = nativeSNI.setStatusNotifierMenu(menuItems);
 
-                nativeTrayWindow = win;
-                nativeTrayUpdateCallback = () => {
-                    nativeSNI.updateStatusNotifierMenuItem(1, win.isVisible() ? "Hide" : "Open");
-                };
-
-                win.on("show", nativeTrayUpdateCallback);
-                win.on("hide", nativeTrayUpdateCallback);
+                // Only asked when a host is about to show the menu, so showing and hiding the window or
+                // toggling arRPC costs nothing while the menu is closed
+                nativeSNI.setStatusNotifierMenuProvider(() => [
+                    { id: 1, label: win.isVisible() ? "Hide" : "Open" },
+                    { id: 5, visible: Settings.store.arRPC === true }
+                ]);
 
                 nativeSNI.setStatusNotifierMenuClickCallback((id: number) => {
                     switch (id) {
@@ -274,6 +280,11 @@ export async function initTray(win: BrowserWindow, setIsQuitting: (val: boolean)
                     else win.show();
                 });
 
+                // Middle click, same as the toggle-mute keybind
+                nativeSNI.setStatusNotifierSecondaryActivateCallback(() => {
+                    win.webContents.send(IpcEvents.TOGGLE_SELF_MUTE);
+                });
+
                 return;
             }
         } catch (e) {}
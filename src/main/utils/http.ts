@@ -6,7 +6,7 @@
 
 import { createWriteStream, mkdirSync } from "original-fs";
 import { dirname } from "path";
-import { Readable } from "stream";
+import { Readable, Transform } from "stream";
 import { pipeline } from "stream/promises";
 import { setTimeout } from "timers/promises";
 
@@ -14,14 +14,33 @@ interface FetchieOptions {
     retryOnNetworkError?: boolean;
 }
 
-export async function downloadFile(url: string, file: string, options: RequestInit = {}, fetchieOpts?: FetchieOptions) {
+/** onProgress receives the downloaded fraction in [0, 1]; it is not called if the size is unknown */
+export async function downloadFile(
+    url: string,
+    file: string,
+    options: RequestInit = {},
+    fetchieOpts?: FetchieOptions,
+    onProgress?: (fraction: number) => void
+) {
     const res = await fetchie(url, options, fetchieOpts);
 
     mkdirSync(dirname(file), { recursive: true });
 
+    const total = Number(res.headers.get("content-length"));
+    let received = 0;
+
+    const progress = new Transform({
+        transform(chunk: Buffer, _encoding, callback) {
+            received += chunk.length;
+            if (onProgress && total > 0) onProgress(Math.min(received / total, 1));
+            callback(null, chunk);
+        }
+    });
+
     await pipeline(
         // @ts-expect-error odd type error
         Readable.fromWeb(res.body!),
+        progress,
         createWriteStream(file, {
             autoClose: true
         })
@@ -8,6 +8,7 @@ import { existsSync } from "fs";
 import { join } from "path";
 
 import { USER_AGENT } from "../constants";
+import { setLauncherProgress } from "../dbus";
 import { VENCORD_DIR } from "../vencordDir";
 import { downloadFile, fetchie } from "./http";
 
@@ -37,12 +38,18 @@ export async function githubGet(endpoint: string) {
 }
 
 export async function downloadVencordAsar() {
-    await downloadFile(
-        "https://github.com/shteppi/DogPack/releases/latest/download/dogpack.asar",
-        VENCORD_DIR,
-        {},
-        { retryOnNetworkError: true }
-    );
+    try {
+        await downloadFile(
+            "https://github.com/shteppi/DogPack/releases/latest/download/dogpack.asar",
+            VENCORD_DIR,
+            {},
+            { retryOnNetworkError: true },
+            // Chunks arrive far more often than the dock can repaint; libvesktop drops repeats and merges the rest
+            setLauncherProgress
+        );
+    } finally {
+        setLauncherProgress(null);
+    }
 }
 
 export function isValidVencordInstall(dir: string) {